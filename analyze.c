@@ -1,86 +1,404 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "filedict.h"
 
 #define error_check() do { if (filedict.error) { printf("[%i] error: %s\n", __LINE__, filedict.error); filedict_deinit(&filedict); return 2; } } while (0)
 
+#define MAX_THREADS 256
+
+/* Chain depths from here on are reported together */
+#define MAX_DEPTH 8
+#define BYTES_BINS 8
+#define VALUES_BINS 16
+#define FILTER_BINS 10
+
+/*
+ * What we found at one depth of the bucket chains. Depth 0 is the initial buckets, depth 1 the
+ * first overflow buckets, and so on.
+ */
+typedef struct depth_stats_t {
+    size_t buckets;
+    size_t entries_used[FILEDICT_BUCKET_ENTRY_COUNT + 1];
+    /* Bytes used per entry, in BYTES_BINS equal slices of 1..FILEDICT_BUCKET_ENTRY_BYTES */
+    size_t entry_bytes[BYTES_BINS];
+} depth_stats_t;
+
+/*
+ * Each thread counts the zeros in [byte_start, byte_end) and looks at the chains of the initial
+ * buckets in [bucket_start, bucket_end). The totals get added up once they're all done.
+ */
+typedef struct analysis_t {
+    pthread_t thread;
+    filedict_t *filedict;
+    size_t byte_start, byte_end;
+    size_t bucket_start, bucket_end;
+
+    unsigned long long zeros;
+    depth_stats_t depths[MAX_DEPTH];
+    size_t values_per_key[VALUES_BINS];
+    size_t keys;
+    /* Sum of buckets visited to find each key, and of buckets in each chain (what a miss visits) */
+    size_t hit_buckets;
+    size_t chain_buckets;
+    size_t used_buckets;
+    size_t longest_chain;
+    const char *last_key;
+    /* Chains with overflow buckets, and what their filters let through */
+    size_t filtered_chains;
+    double filter_false_positives;
+    double filtered_miss_buckets;
+    /* False-positive rates of those filters, in FILTER_BINS equal slices of 0-100% */
+    size_t filter_rates[FILTER_BINS];
+} analysis_t;
+
+static unsigned long long count_zeros(const unsigned char *data, size_t len) {
+    unsigned long long zeros = 0;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= len; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        zeros += __builtin_popcount((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zero)));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        zeros += __builtin_popcount((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)));
+    }
+#endif
+    for (; i < len; ++i) {
+        zeros += (data[i] == 0);
+    }
+    return zeros;
+}
+
+#define histogram_add(histogram, bins, i) ((histogram)[(i) < (bins) ? (i) : (bins) - 1] += 1)
+
+/*
+ * Returns how many values the entry holds, and sets *bytes_used to where they end.
+ */
+static size_t entry_values(filedict_t *filedict, filedict_bucket_entry_t *entry, size_t *bytes_used) {
+    size_t key_len = strnlen(entry->bytes, FILEDICT_BUCKET_ENTRY_BYTES), slot_i, values = 0;
+
+    for (slot_i = filedict_entry_first_value(filedict, entry, key_len); slot_i != 0; slot_i = filedict_entry_next_value(filedict, entry, slot_i)) {
+        values += 1;
+    }
+    *bytes_used = filedict_entry_tail(filedict, entry, key_len, NULL, 0);
+    return values;
+}
+
+#define next_bucket(filedict, bucket) \
+    ((bucket)->next ? (filedict_bucket_t *)((char *)(filedict)->data + (bucket)->next) : NULL)
+
+/*
+ * Returns 1 if an entry before (bucket, entry_i) in the chain starting at head has the same key.
+ */
+static int seen_before(filedict_t *filedict, filedict_bucket_t *head, filedict_bucket_t *bucket, size_t entry_i) {
+    filedict_bucket_t *b;
+    unsigned long long hits;
+    size_t i;
+
+    for (b = head; b != NULL; b = next_bucket(filedict, b)) {
+        for (hits = filedict_bucket_match(b, bucket->tags[entry_i]); hits != 0; hits &= hits - 1) {
+            i = __builtin_ctzll(hits);
+            if (b == bucket && i == entry_i) return 0;
+            if (strncmp(b->entries[i].bytes, bucket->entries[entry_i].bytes, FILEDICT_BUCKET_ENTRY_BYTES) == 0) return 1;
+        }
+        if (b == bucket) return 0;
+    }
+    return 0;
+}
+
+/*
+ * Counts the values of the key at (bucket, entry_i), in that entry and any later ones in the chain.
+ */
+static size_t key_values(filedict_t *filedict, filedict_bucket_t *bucket, size_t entry_i) {
+    filedict_bucket_t *b;
+    unsigned long long hits;
+    size_t i, values = 0, bytes_used;
+
+    for (b = bucket; b != NULL; b = next_bucket(filedict, b)) {
+        hits = filedict_bucket_match(b, bucket->tags[entry_i]);
+        if (b == bucket) hits &= ~0ULL << entry_i;
+
+        for (; hits != 0; hits &= hits - 1) {
+            i = __builtin_ctzll(hits);
+            if (strncmp(b->entries[i].bytes, bucket->entries[entry_i].bytes, FILEDICT_BUCKET_ENTRY_BYTES) == 0) {
+                values += entry_values(filedict, &b->entries[i], &bytes_used);
+            }
+        }
+    }
+    return values;
+}
+
+/*
+ * Returns the chance that a key that isn't in the chain gets past its filter. Each key sets
+ * FILEDICT_CHAIN_FILTER_HASHES bits, so that's the fraction of bits set to that power.
+ */
+static double filter_false_positive_rate(filedict_t *filedict, size_t bucket_i) {
+    unsigned long long *filter = filedict_chain_filter(filedict, bucket_i);
+    unsigned int bits = ((filedict_header_t *)filedict->data)->chain_filter_bits, i;
+    size_t set = 0;
+    double rate = 1.0;
+
+    for (i = 0; i < bits / 64; ++i) set += __builtin_popcountll(filter[i]);
+    for (i = 0; i < FILEDICT_CHAIN_FILTER_HASHES; ++i) rate *= (double)set / (double)bits;
+    return rate;
+}
+
+static void *analyze_part(void *arg) {
+    analysis_t *part = (analysis_t *)arg;
+    filedict_t *filedict = part->filedict;
+    filedict_bucket_t *head, *bucket;
+    unsigned long long used;
+    size_t j, depth, entry_i, bytes_used;
+    double rate;
+
+    part->zeros = count_zeros((unsigned char *)filedict->data + part->byte_start, part->byte_end - part->byte_start);
+
+    for (j = part->bucket_start; j < part->bucket_end; ++j) {
+        head = &filedict_buckets(filedict)[j];
+        if (head->tags[0] == FILEDICT_TAG_EMPTY) continue;
+
+        part->used_buckets += 1;
+        part->last_key = head->entries[0].bytes;
+
+        for (bucket = head, depth = 0; bucket != NULL; bucket = next_bucket(filedict, bucket), ++depth) {
+            depth_stats_t *stats = &part->depths[depth < MAX_DEPTH ? depth : MAX_DEPTH - 1];
+
+            used = filedict_bucket_live(bucket);
+            stats->buckets += 1;
+            stats->entries_used[__builtin_popcountll(used)] += 1;
+
+            for (; used != 0; used &= used - 1) {
+                entry_i = __builtin_ctzll(used);
+                entry_values(filedict, &bucket->entries[entry_i], &bytes_used);
+                histogram_add(stats->entry_bytes, BYTES_BINS, (bytes_used - 1) * BYTES_BINS / FILEDICT_BUCKET_ENTRY_BYTES);
+
+                if (seen_before(filedict, head, bucket, entry_i)) continue;
+                part->keys += 1;
+                part->hit_buckets += depth + 1;
+                histogram_add(part->values_per_key, VALUES_BINS, key_values(filedict, bucket, entry_i));
+            }
+        }
+
+        part->chain_buckets += depth;
+        if (depth - 1 > part->longest_chain) part->longest_chain = depth - 1;
+
+        /* A miss always looks at the initial bucket, and at the rest only when the filter lets it */
+        if (depth > 1 && filedict_chain_filter(filedict, j) != NULL) {
+            rate = filter_false_positive_rate(filedict, j);
+            part->filtered_chains += 1;
+            part->filter_false_positives += rate;
+            part->filtered_miss_buckets += 1.0 + rate * (double)(depth - 1);
+            histogram_add(part->filter_rates, FILTER_BINS, (size_t)(rate * FILTER_BINS));
+        }
+        else {
+            part->filtered_miss_buckets += depth;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Prints the non-empty bins. With open_ended, the last bin also counts everything bigger.
+ */
+static void print_histogram(const char *label, size_t *histogram, size_t bins, size_t first, size_t bin_width, int open_ended) {
+    size_t total = 0, i;
+
+    for (i = 0; i < bins; ++i) total += histogram[i];
+    if (total == 0) return;
+
+    printf("  %s:\n", label);
+    for (i = 0; i < bins; ++i) {
+        if (histogram[i] == 0) continue;
+        if (bin_width > 1) {
+            printf("    %4li-%-4li %12li  %6.2f%%\n",
+                first + i * bin_width, first + (i + 1) * bin_width - 1,
+                histogram[i], (double)histogram[i] / (double)total * 100.0);
+        }
+        else {
+            printf("    %4li%-5s %12li  %6.2f%%\n",
+                first + i, open_ended && i == bins - 1 ? "+" : "",
+                histogram[i], (double)histogram[i] / (double)total * 100.0);
+        }
+    }
+}
+
 int main(int argc, const char **argv) {
-    int i;
+    int i, arg_i = 1;
+    size_t thread_count = (size_t)sysconf(_SC_NPROCESSORS_ONLN), started, t, d, k;
     filedict_t filedict;
+    analysis_t *parts = calloc(MAX_THREADS, sizeof(analysis_t));
     filedict_init(&filedict);
 
-    if (argc == 1) {
-        printf("Usage: ./analyze dict-file-1.fdict dict-file-2.fdict ...\n");
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        thread_count = strtoul(argv[2], NULL, 10);
+        arg_i = 3;
+    }
+    if (thread_count < 1) thread_count = 1;
+    if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+
+    if (argc - arg_i < 1) {
+        printf("Usage: ./analyze [-j threads] dict-file-1.fdict dict-file-2.fdict ...\n");
         return 1;
     }
 
-    for (i = 1; i < argc; ++i, filedict_deinit(&filedict)) {
-        long long zeros = 0;
-        long long nonzeros = 0;
-        size_t j, k, bucket_count;
+    for (i = arg_i; i < argc; ++i, filedict_deinit(&filedict)) {
+        analysis_t total;
         filedict_header_t *header;
-        filedict_bucket_t *hashmap;
-        const char *last_entry_key;
+        size_t bucket_count, part_count = thread_count;
 
         filedict_open_readonly(&filedict, argv[i]);
         error_check();
 
-        if (i > 1) printf("\n\n");
+        if (i > arg_i) printf("\n\n");
 
         /*
          * First, print the filename
          */
         printf("--- %s ---\n", argv[i]);
 
+        header = (filedict_header_t *)filedict.data;
+        bucket_count = header->initial_bucket_count;
+        if (part_count > bucket_count) part_count = bucket_count;
+
         /*
-         * Simple analysis of the number of zeros in the file
+         * Split the file and the initial buckets evenly between threads
          */
-        printf("\n");
-        for (j = 0; j < filedict.data_len; ++j) {
-            zeros += (((char *)filedict.data)[j] == 0);
-            nonzeros += (((char *)filedict.data)[j] != 0);
+        memset(parts, 0, MAX_THREADS * sizeof(analysis_t));
+        for (t = 0; t < part_count; ++t) {
+            parts[t].filedict = &filedict;
+            parts[t].byte_start = filedict.data_len * t / part_count;
+            parts[t].byte_end = filedict.data_len * (t + 1) / part_count;
+            parts[t].bucket_start = bucket_count * t / part_count;
+            parts[t].bucket_end = bucket_count * (t + 1) / part_count;
+        }
+        for (started = 1; started < part_count; ++started) {
+            if (pthread_create(&parts[started].thread, NULL, analyze_part, &parts[started]) != 0) break;
+        }
+        /* Whatever didn't get a thread runs on this one */
+        analyze_part(&parts[0]);
+        for (t = started; t < part_count; ++t) analyze_part(&parts[t]);
+        for (t = 1; t < started; ++t) pthread_join(parts[t].thread, NULL);
+
+        memset(&total, 0, sizeof(total));
+        total.last_key = "";
+        for (t = 0; t < part_count; ++t) {
+            analysis_t *part = &parts[t];
+
+            total.zeros += part->zeros;
+            total.keys += part->keys;
+            total.hit_buckets += part->hit_buckets;
+            total.chain_buckets += part->chain_buckets;
+            total.used_buckets += part->used_buckets;
+            if (part->longest_chain > total.longest_chain) total.longest_chain = part->longest_chain;
+            if (part->last_key) total.last_key = part->last_key;
+            total.filtered_chains += part->filtered_chains;
+            total.filter_false_positives += part->filter_false_positives;
+            total.filtered_miss_buckets += part->filtered_miss_buckets;
+            for (k = 0; k < FILTER_BINS; ++k) total.filter_rates[k] += part->filter_rates[k];
+            for (k = 0; k < VALUES_BINS; ++k) total.values_per_key[k] += part->values_per_key[k];
+
+            for (d = 0; d < MAX_DEPTH; ++d) {
+                total.depths[d].buckets += part->depths[d].buckets;
+                for (k = 0; k <= FILEDICT_BUCKET_ENTRY_COUNT; ++k) {
+                    total.depths[d].entries_used[k] += part->depths[d].entries_used[k];
+                }
+                for (k = 0; k < BYTES_BINS; ++k) total.depths[d].entry_bytes[k] += part->depths[d].entry_bytes[k];
+            }
         }
 
-        printf("zeros:    %lli\n", zeros);
-        printf("nonzeros: %lli\n", nonzeros);
-        printf("zero %%:   %f%%\n", (double)zeros / (double)(zeros + nonzeros) * 100.0);
+        /*
+         * Simple analysis of the number of zeros in the file
+         */
+        printf("\n");
+        printf("zeros:    %llu\n", total.zeros);
+        printf("nonzeros: %llu\n", filedict.data_len - total.zeros);
+        printf("zero %%:   %f%%\n", (double)total.zeros / (double)filedict.data_len * 100.0);
 
         /*
          * Now let's look at actual hashmap info
          */
-        header = (filedict_header_t *)filedict.data;
-        hashmap = (filedict_bucket_t*)(filedict.data + sizeof(filedict_header_t));
+        printf("\n");
+        printf("initial bucket count:  %u\n", header->initial_bucket_count);
+        printf("overflow bucket count: %llu\n", header->overflow_bucket_count);
+        printf("heap bytes:            %llu\n", header->heap_bytes);
+        printf("generation:            %llu\n", header->generation);
 
         printf("\n");
-        printf("hashmap count: %i\n", header->hashmap_count);
-        printf("initial bucket count: %i\n", header->initial_bucket_count);
+        printf("used buckets:   %li\n", total.used_buckets);
+        printf("unused buckets: %li\n", bucket_count - total.used_buckets);
+        printf("longest chain:  %li overflow buckets\n", total.longest_chain);
+        printf("last key:       %s\n", total.last_key);
+        printf("keys:           %li\n", total.keys);
 
-        bucket_count = header->initial_bucket_count;
+        /*
+         * What a lookup costs, in buckets visited. A miss visits the whole chain of its bucket.
+         */
+        printf("\n");
+        printf("buckets visited per hit:  %.3f\n", total.keys ? (double)total.hit_buckets / (double)total.keys : 0.0);
+        printf("buckets visited per miss: %.3f\n", (double)(total.chain_buckets + bucket_count - total.used_buckets) / (double)bucket_count);
+
+        /*
+         * How well the chain filters keep misses out of overflow buckets
+         */
+        if (header->chain_filter_offset != 0) {
+            printf("\n");
+            printf("chain filter bits:        %u\n", header->chain_filter_bits);
+            printf("chains with overflow:     %li\n", total.filtered_chains);
+            printf("filter false positives:   %.3f%%\n",
+                total.filtered_chains ? total.filter_false_positives / (double)total.filtered_chains * 100.0 : 0.0);
+            printf("buckets visited per miss: %.3f (with filters)\n",
+                (total.filtered_miss_buckets + bucket_count - total.used_buckets) / (double)bucket_count);
+            print_histogram("filter false-positive rates (%)", total.filter_rates, FILTER_BINS, 0, 100 / FILTER_BINS, 0);
+        }
+
+        /*
+         * Keys in the log get checked one by one by every prefix scan, so a big log means slow scans
+         */
+        if (header->key_index_offset != 0) {
+            filedict_key_index_t *index = filedict_key_index_at(&filedict, header->key_index_offset);
+            filedict_key_log_t *log = filedict_key_log_at(&filedict, header->key_log_offset);
+
+            printf("\n");
+            printf("keys in key index:  %llu\n", index->key_count);
+            printf("key log bytes used: %llu of %llu\n", log->used, log->capacity);
+        }
 
-        for (j = 0; j < header->hashmap_count; ++j) {
-            size_t used_buckets = 0;
-            size_t unused_buckets = 0;
+        /*
+         * Readers that fall further behind than the change log holds have to read everything again
+         */
+        if (header->change_log_offset != 0) {
+            printf("\n");
+            printf("changes recorded:   %llu\n", header->change_seq);
+            printf("change log records: %llu\n", header->change_log_records);
+        }
 
-            for (k = 0; k < bucket_count; ++k) {
-                filedict_bucket_t *bucket = &hashmap[k];
+        printf("\n");
+        print_histogram("values per key", total.values_per_key, VALUES_BINS, 0, 1, 1);
 
-                used_buckets += (bucket->entries[0].bytes[0] != 0);
-                unused_buckets += (bucket->entries[0].bytes[0] == 0);
+        for (d = 0; d < MAX_DEPTH; ++d) {
+            if (total.depths[d].buckets == 0) continue;
 
-                if (bucket->entries[0].bytes[0] != 0) {
-                    last_entry_key = bucket->entries[0].bytes;
-                }
-            }
             printf("\n");
-            printf("hashmap %li used buckets:   %li\n", j+1, used_buckets);
-            printf("hashmap %li unused buckets: %li\n", j+1, unused_buckets);
-            printf("hashmap %li last key:       %s\n", j+1, last_entry_key);
+            if (d == 0) printf("initial buckets (%li used):\n", total.depths[d].buckets);
+            else printf("overflow buckets at depth %li%s (%li):\n", d, d == MAX_DEPTH - 1 ? " and deeper" : "", total.depths[d].buckets);
 
-            hashmap += bucket_count;
+            print_histogram("entries used per bucket", total.depths[d].entries_used, FILEDICT_BUCKET_ENTRY_COUNT + 1, 0, 1, 0);
+            print_histogram(
+                "bytes used per entry",
+                total.depths[d].entry_bytes, BYTES_BINS, 1, FILEDICT_BUCKET_ENTRY_BYTES / BYTES_BINS, 0
+            );
         }
     }
 
+    free(parts);
     filedict_deinit(&filedict);
     return 0;
 }
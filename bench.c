@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "filedict.h"
+
+#define error_check(filedict) do { if ((filedict).error) { printf("[%i] error: %s\n", __LINE__, (filedict).error); exit(2); } } while (0)
+
+#define BENCH_FILE "bench.data"
+#define BENCH_MERGE_FILE "bench-merged.data"
+
+/*
+ * Every workload is generated from a fixed seed, so runs (and versions) can be compared.
+ */
+typedef struct workload_t {
+    const char *name;
+    /* Pick keys with a Zipfian distribution instead of uniformly */
+    int zipf;
+    /* How many values each key gets. With zipf, only the average. */
+    size_t values_per_key;
+    /* Keys that look like file paths instead of short ones */
+    int path_keys;
+    /* 0 means enough buckets for everything to fit at about 50% load */
+    size_t bucket_count;
+    /* FILEDICT_FEATURE_* flags to create the file with */
+    unsigned int features;
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "uniform-short-1",  0, 1, 0, 0, 0 },
+    { "uniform-path-8",   0, 8, 1, 0, 0 },
+    { "zipf-short-many",  1, 16, 0, 0, 0 },
+    { "long-chains",      0, 1, 0, 64, 0 },
+    { "hot-keys",         0, 256, 0, 0, 0 },
+    { "hot-keys-prefixed", 0, 256, 0, 0, FILEDICT_FEATURE_LENGTH_PREFIXED },
+};
+
+typedef struct result_t {
+    const char *workload;
+    const char *op;
+    size_t ops;
+    double seconds;
+    size_t file_size;
+    long minor_faults;
+    long major_faults;
+} result_t;
+
+typedef struct measurement_t {
+    struct timespec start;
+    struct rusage usage;
+    int who;
+} measurement_t;
+
+static result_t results[64];
+static size_t result_count = 0;
+
+static unsigned long long rng_state;
+
+/* xorshift64*, good enough for picking keys */
+static unsigned long long rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(void) {
+    return (double)(rng_next() >> 11) / (double)(1ULL << 53);
+}
+
+/*
+ * Fills key_ids with count picks from [0, key_count) with Zipf's law (s = 1), by binary searching
+ * the cumulative distribution.
+ */
+static void pick_zipf(size_t *key_ids, size_t count, size_t key_count) {
+    double *cdf = malloc(key_count * sizeof(double));
+    double total = 0.0;
+    size_t i;
+
+    for (i = 0; i < key_count; ++i) {
+        total += 1.0 / (double)(i + 1);
+        cdf[i] = total;
+    }
+    for (i = 0; i < count; ++i) {
+        double target = rng_unit() * total;
+        size_t lo = 0, hi = key_count - 1;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < target) lo = mid + 1;
+            else hi = mid;
+        }
+        key_ids[i] = lo;
+    }
+    free(cdf);
+}
+
+static void format_key(char *dest, size_t dest_len, const workload_t *workload, size_t key_id) {
+    if (workload->path_keys) {
+        snprintf(
+            dest, dest_len,
+            "/home/bench/projects/app/lib/module_%zu/component_%zu/file_%zu.rb",
+            key_id % 97, key_id % 1013, key_id
+        );
+    }
+    else {
+        snprintf(dest, dest_len, "k%zu", key_id);
+    }
+}
+
+static void measure_start(measurement_t *measurement, int who) {
+    measurement->who = who;
+    getrusage(who, &measurement->usage);
+    clock_gettime(CLOCK_MONOTONIC, &measurement->start);
+}
+
+static void measure_end(measurement_t *measurement, const char *workload, const char *op, size_t ops, const char *path) {
+    struct timespec end;
+    struct rusage usage;
+    struct stat info;
+    result_t *result = &results[result_count++];
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(measurement->who, &usage);
+
+    result->workload = workload;
+    result->op = op;
+    result->ops = ops;
+    result->seconds = (double)(end.tv_sec - measurement->start.tv_sec)
+        + (double)(end.tv_nsec - measurement->start.tv_nsec) / 1e9;
+    result->minor_faults = usage.ru_minflt - measurement->usage.ru_minflt;
+    result->major_faults = usage.ru_majflt - measurement->usage.ru_majflt;
+    result->file_size = stat(path, &info) == 0 ? info.st_size : 0;
+}
+
+static void run_workload(const workload_t *workload, size_t op_count) {
+    size_t key_count = op_count / workload->values_per_key;
+    size_t bucket_count = workload->bucket_count;
+    size_t *key_ids = malloc(op_count * sizeof(size_t));
+    size_t i, visited;
+    char key[256], value[64];
+    filedict_t filedict;
+    filedict_read_t read;
+    filedict_scan_t scan;
+    measurement_t measurement;
+    int success;
+
+    if (key_count == 0) key_count = 1;
+    if (bucket_count == 0) bucket_count = key_count * 2 / FILEDICT_BUCKET_ENTRY_COUNT + 1;
+
+    rng_state = 0x62656e6368ULL;
+    if (workload->zipf) {
+        pick_zipf(key_ids, op_count, key_count);
+    }
+    else {
+        for (i = 0; i < op_count; ++i) key_ids[i] = i % key_count;
+    }
+
+    /* insert */
+    filedict_init(&filedict);
+    filedict.features = workload->features;
+    filedict_open_f(&filedict, BENCH_FILE, O_CREAT | O_TRUNC | O_RDWR, bucket_count);
+    error_check(filedict);
+    measure_start(&measurement, RUSAGE_SELF);
+    for (i = 0; i < op_count; ++i) {
+        format_key(key, sizeof(key), workload, key_ids[i]);
+        snprintf(value, sizeof(value), "v%zu", i);
+        filedict_insert(&filedict, key, value);
+    }
+    measure_end(&measurement, workload->name, "insert", op_count, BENCH_FILE);
+    error_check(filedict);
+    filedict_deinit(&filedict);
+
+    /* insert_unique, into a fresh file. Every value is new, so each one scans its whole key. */
+    filedict_init(&filedict);
+    filedict.features = workload->features;
+    filedict_open_f(&filedict, BENCH_MERGE_FILE, O_CREAT | O_TRUNC | O_RDWR, bucket_count);
+    error_check(filedict);
+    measure_start(&measurement, RUSAGE_SELF);
+    for (i = 0; i < op_count; ++i) {
+        format_key(key, sizeof(key), workload, key_ids[i]);
+        snprintf(value, sizeof(value), "v%zu", i);
+        filedict_insert_unique(&filedict, key, value);
+    }
+    measure_end(&measurement, workload->name, "insert_unique", op_count, BENCH_MERGE_FILE);
+    error_check(filedict);
+    filedict_deinit(&filedict);
+
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, BENCH_FILE);
+    error_check(filedict);
+
+    /* get + get_next through all values of the key */
+    visited = 0;
+    measure_start(&measurement, RUSAGE_SELF);
+    for (i = 0; i < op_count; ++i) {
+        format_key(key, sizeof(key), workload, key_ids[i]);
+        read = filedict_get(&filedict, key);
+        for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+            visited += 1;
+        }
+    }
+    measure_end(&measurement, workload->name, "get_hit", op_count, BENCH_FILE);
+    if (visited < op_count) { printf("%s: some lookups missed\n", workload->name); exit(2); }
+
+    /* get misses */
+    measure_start(&measurement, RUSAGE_SELF);
+    for (i = 0; i < op_count; ++i) {
+        format_key(key, sizeof(key), workload, key_count + key_ids[i]);
+        read = filedict_get(&filedict, key);
+        if (read.value != NULL) { printf("%s: a miss found a value\n", workload->name); exit(2); }
+    }
+    measure_end(&measurement, workload->name, "get_miss", op_count, BENCH_FILE);
+
+    /* full iteration */
+    visited = 0;
+    measure_start(&measurement, RUSAGE_SELF);
+    read = filedict_get(&filedict, NULL);
+    for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+        visited += 1;
+    }
+    measure_end(&measurement, workload->name, "iterate", visited, BENCH_FILE);
+
+    /* full scan in file order */
+    visited = 0;
+    measure_start(&measurement, RUSAGE_SELF);
+    for (scan = filedict_scan(&filedict); scan.value; filedict_scan_next(&scan)) {
+        visited += 1;
+    }
+    measure_end(&measurement, workload->name, "scan", visited, BENCH_FILE);
+    filedict_deinit(&filedict);
+
+    /* merge, into an empty file */
+    unlink(BENCH_MERGE_FILE);
+    measure_start(&measurement, RUSAGE_CHILDREN);
+    if (system("./merge " BENCH_MERGE_FILE " " BENCH_FILE) != 0) {
+        printf("%s: merge failed\n", workload->name);
+        exit(2);
+    }
+    measure_end(&measurement, workload->name, "merge", op_count, BENCH_MERGE_FILE);
+
+    unlink(BENCH_FILE);
+    unlink(BENCH_MERGE_FILE);
+    free(key_ids);
+}
+
+static void print_text(void) {
+    size_t i;
+
+    printf("%-18s %-14s %10s %12s %14s %12s %10s %10s\n",
+        "workload", "op", "ops", "ns/op", "ops/s", "file bytes", "minflt", "majflt");
+    for (i = 0; i < result_count; ++i) {
+        result_t *r = &results[i];
+        printf("%-18s %-14s %10zu %12.1f %14.0f %12zu %10li %10li\n",
+            r->workload, r->op, r->ops,
+            r->seconds * 1e9 / (double)r->ops, (double)r->ops / r->seconds,
+            r->file_size, r->minor_faults, r->major_faults);
+    }
+}
+
+static void print_json(void) {
+    size_t i;
+
+    printf("[\n");
+    for (i = 0; i < result_count; ++i) {
+        result_t *r = &results[i];
+        printf(
+            "  {\"workload\": \"%s\", \"op\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f, "
+            "\"ops_per_sec\": %.0f, \"file_bytes\": %zu, \"minor_faults\": %li, \"major_faults\": %li}%s\n",
+            r->workload, r->op, r->ops,
+            r->seconds * 1e9 / (double)r->ops, (double)r->ops / r->seconds,
+            r->file_size, r->minor_faults, r->major_faults,
+            i + 1 < result_count ? "," : ""
+        );
+    }
+    printf("]\n");
+}
+
+int main(int argc, const char **argv) {
+    size_t op_count = 100000, i;
+    int json = 0, arg_i;
+
+    for (arg_i = 1; arg_i < argc; ++arg_i) {
+        if (strcmp(argv[arg_i], "--json") == 0) {
+            json = 1;
+        }
+        else if (strcmp(argv[arg_i], "-n") == 0 && arg_i + 1 < argc) {
+            op_count = strtoul(argv[++arg_i], NULL, 10);
+        }
+        else {
+            printf("Usage: ./benchmark [-n operations] [--json]\n");
+            printf("Runs every workload with that many operations (default 100000) and reports timings.\n");
+            return 1;
+        }
+    }
+    if (op_count == 0) op_count = 1;
+
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+        run_workload(&workloads[i], op_count);
+    }
+
+    if (json) print_json();
+    else print_text();
+    return 0;
+}
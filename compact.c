@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <signal.h>
+
+#include "filedict.h"
+
+#define error_check(filedict) do { if (filedict.error) { printf("[%i] error: %s\n", __LINE__, filedict.error); filedict_deinit(&filedict); return 2; } } while (0)
+
+/*
+ * Aim for buckets to be this full (out of 100) right after compacting, leaving some room to grow
+ * before anything needs an overflow bucket.
+ */
+#define TARGET_LOAD_PERCENT 50
+
+typedef struct compact_stats_t {
+    size_t file_size;
+    long long zeros;
+    size_t overflow_buckets;
+    size_t longest_chain;
+    size_t entries;
+    size_t values;
+    size_t used_bytes;
+} compact_stats_t;
+
+typedef void (*entry_callback_t)(filedict_t *filedict, filedict_bucket_entry_t *entry, void *context);
+
+static void each_bucket_entry(filedict_t *filedict, filedict_bucket_t *bucket, entry_callback_t callback, void *context) {
+    unsigned long long used = filedict_bucket_live(bucket);
+
+    for (; used != 0; used &= used - 1) {
+        callback(filedict, &bucket->entries[__builtin_ctzll(used)], context);
+    }
+}
+
+/*
+ * Calls callback for every used entry, in the order the entries appear in the file.
+ * That's the initial buckets first, followed by the overflow buckets in the order they were added.
+ */
+static void each_entry(filedict_t *filedict, entry_callback_t callback, void *context) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_bucket_t *hashmap = (filedict_bucket_t *)(filedict->data + sizeof(filedict_header_t));
+    size_t i, offset = filedict_file_size(header->initial_bucket_count);
+
+    for (i = 0; i < header->initial_bucket_count; ++i) {
+        each_bucket_entry(filedict, &hashmap[i], callback, context);
+    }
+
+    while (offset < header->data_end) {
+        filedict_block_t *block = (filedict_block_t *)(filedict->data + offset);
+        /* A block another writer is still allocating. Nothing past it is ready yet. */
+        if (block->size == 0) break;
+        offset += sizeof(filedict_block_t);
+
+        if (block->type == FILEDICT_BLOCK_BUCKET) {
+            each_bucket_entry(filedict, (filedict_bucket_t *)(filedict->data + offset), callback, context);
+        }
+        offset += block->size;
+    }
+}
+
+static void count_entry(filedict_t *filedict, filedict_bucket_entry_t *entry, void *context) {
+    compact_stats_t *stats = (compact_stats_t *)context;
+    size_t key_len = strlen(entry->bytes), slot_i;
+
+    for (slot_i = filedict_entry_first_value(filedict, entry, key_len); slot_i != 0; slot_i = filedict_entry_next_value(filedict, entry, slot_i)) {
+        stats->values += 1;
+    }
+
+    stats->entries += 1;
+    stats->used_bytes += filedict_entry_tail(filedict, entry, key_len, NULL, 0);
+}
+
+typedef struct copy_context_t {
+    filedict_t *src;
+    filedict_t *dest;
+} copy_context_t;
+
+static void copy_entry(filedict_t *filedict, filedict_bucket_entry_t *entry, void *context) {
+    copy_context_t *copy = (copy_context_t *)context;
+    const char *key = entry->bytes;
+    size_t slot_i = filedict_entry_first_value(filedict, entry, strlen(key));
+    const char *value;
+
+    for (; slot_i != 0 && copy->dest->error == NULL; slot_i = filedict_entry_next_value(filedict, entry, slot_i)) {
+        value = filedict_resolve_value(copy->src, &entry->bytes[slot_i]);
+        /* Better to stop than to write a file that's quietly missing a value */
+        if (value == NULL) {
+            copy->dest->error = copy->src->error ? copy->src->error : "A heap reference points outside the file";
+            return;
+        }
+        filedict_insert(copy->dest, key, value);
+    }
+}
+
+static void gather_stats(filedict_t *filedict, compact_stats_t *stats) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_bucket_t *hashmap = (filedict_bucket_t *)(filedict->data + sizeof(filedict_header_t));
+    size_t i, chain;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->file_size = filedict->data_len;
+    stats->overflow_buckets = header->overflow_bucket_count;
+
+    for (i = 0; i < filedict->data_len; ++i) {
+        stats->zeros += (((char *)filedict->data)[i] == 0);
+    }
+
+    for (i = 0; i < header->initial_bucket_count; ++i) {
+        filedict_bucket_t *bucket = &hashmap[i];
+
+        for (chain = 0; bucket->next != 0; ++chain) {
+            bucket = (filedict_bucket_t *)(filedict->data + bucket->next);
+        }
+        if (chain > stats->longest_chain) stats->longest_chain = chain;
+    }
+
+    each_entry(filedict, count_entry, stats);
+}
+
+static void print_stats(const char *label, compact_stats_t *stats, unsigned int bucket_count) {
+    printf("%s:\n", label);
+    printf("  initial bucket count:  %u\n", bucket_count);
+    printf("  overflow bucket count: %li\n", stats->overflow_buckets);
+    printf("  longest chain:         %li overflow buckets\n", stats->longest_chain);
+    printf("  file size:             %li bytes\n", stats->file_size);
+    printf("  zero %%:                %f%%\n", (double)stats->zeros / (double)stats->file_size * 100.0);
+}
+
+int main(int argc, const char **argv) {
+    int i;
+    filedict_t src, dest;
+    copy_context_t copy = { &src, &dest };
+    compact_stats_t before, after;
+    char tmp_path[4096];
+
+    if (argc == 1) {
+        printf("Usage: ./compact dict-file-1.fdict dict-file-2.fdict ...\n");
+        printf("Rewrites each file with a bucket count that fits its contents.\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; ++i) {
+        size_t needed_entries, bucket_count;
+        unsigned int before_bucket_count;
+
+        filedict_init(&src);
+        filedict_open_readonly(&src, argv[i]);
+        error_check(src);
+
+        if (i > 1) printf("\n\n");
+        printf("--- %s ---\n\n", argv[i]);
+
+        gather_stats(&src, &before);
+        before_bucket_count = ((filedict_header_t *)src.data)->initial_bucket_count;
+
+        /*
+         * Values get packed into as few entries as possible when we re-insert them, so count
+         * whichever is bigger: the number of keys, or the number of entries the bytes would fill.
+         */
+        needed_entries = before.used_bytes / FILEDICT_BUCKET_ENTRY_BYTES + 1;
+        if (needed_entries < before.entries) needed_entries = before.entries;
+
+        bucket_count = needed_entries * 100 / (FILEDICT_BUCKET_ENTRY_COUNT * TARGET_LOAD_PERCENT) + 1;
+        if (bucket_count < 16) bucket_count = 16;
+
+        snprintf(tmp_path, sizeof(tmp_path), "%s.compact", argv[i]);
+
+        filedict_init(&dest);
+        dest.hash_id = src.hash_id;
+        dest.hash_seed = src.hash_seed;
+        dest.features = src.features;
+        filedict_open_f(&dest, tmp_path, O_CREAT | O_TRUNC | O_RDWR, bucket_count);
+        error_check(dest);
+
+        each_entry(&src, copy_entry, &copy);
+        if (dest.error) unlink(tmp_path);
+        error_check(dest);
+
+        filedict_commit(&dest);
+        if (dest.error) unlink(tmp_path);
+        error_check(dest);
+
+        if (rename(tmp_path, argv[i]) != 0) {
+            printf("[%i] error: %s\n", __LINE__, strerror(errno));
+            unlink(tmp_path);
+            filedict_deinit(&dest);
+            filedict_deinit(&src);
+            return 2;
+        }
+
+        gather_stats(&dest, &after);
+        print_stats("before", &before, before_bucket_count);
+        printf("\n");
+        print_stats("after", &after, bucket_count);
+
+        filedict_deinit(&dest);
+        filedict_deinit(&src);
+    }
+
+    return 0;
+}
@@ -4,9 +4,26 @@
 #include <stddef.h>
 
 #ifndef FILEDICT_BUCKET_ENTRY_BYTES
-#define FILEDICT_BUCKET_ENTRY_BYTES 512
+#define FILEDICT_BUCKET_ENTRY_BYTES 256
 #endif
 
+/*
+ * Values at least this long are stored in the value heap at the end of the file, and the entry
+ * only holds a reference to them. So are values that wouldn't fit in an entry at all.
+ */
+#ifndef FILEDICT_HEAP_VALUE_BYTES
+#define FILEDICT_HEAP_VALUE_BYTES 64
+#endif
+
+/*
+ * A heap reference is FILEDICT_HEAP_MARKER followed by the file offset of the value, 7 bits per
+ * byte with the high bit set. None of those bytes can be 0, so references sit among the inline
+ * NUL-separated values like any other string. 0xFF never appears in UTF-8, and values that start
+ * with it anyway are always stored in the heap.
+ */
+#define FILEDICT_HEAP_MARKER 0xFF
+#define FILEDICT_HEAP_REF_BYTES 11
+
 typedef struct filedict_bucket_entry_t {
     char bytes[FILEDICT_BUCKET_ENTRY_BYTES];
 } filedict_bucket_entry_t;
@@ -15,11 +32,195 @@ typedef struct filedict_bucket_entry_t {
 #define FILEDICT_BUCKET_ENTRY_COUNT 4
 #endif
 
+#if FILEDICT_BUCKET_ENTRY_COUNT > 64
+#error "FILEDICT_BUCKET_ENTRY_COUNT can be at most 64"
+#endif
+
+/*
+ * Each bucket starts with one tag byte per entry. A tag is a byte of the key's hash, so lookups can
+ * compare all tags in a bucket at once and only look at the entries whose tag matches.
+ *
+ * The tag array is padded to a multiple of 16 so it can always be loaded as whole SSE2 vectors.
+ */
+#define FILEDICT_BUCKET_TAG_BYTES (((FILEDICT_BUCKET_ENTRY_COUNT + 15) / 16) * 16)
+
+/*
+ * Tag values below FILEDICT_TAG_MIN are reserved for marking the state of a slot.
+ *
+ * A removed entry keeps its bytes and gets FILEDICT_TAG_REMOVED, so it never matches a key again.
+ * It isn't FILEDICT_TAG_EMPTY, so a bucket with removed entries can still link to overflow buckets.
+ */
+#define FILEDICT_TAG_EMPTY 0
+#define FILEDICT_TAG_REMOVED 1
+#define FILEDICT_TAG_MIN 2
+
+/*
+ * When all entries of a bucket are taken, it links to an overflow bucket allocated from the end of
+ * the file. "next" is the file offset of that bucket, or 0 when there isn't one. Since overflow
+ * buckets are only added to full buckets, a bucket with a free entry is always the end of its chain.
+ *
+ * "lock" is only used in the initial buckets, by writers of files with FILEDICT_FEATURE_MULTI_WRITER.
+ * It holds the thread ID of the writer that's currently changing the bucket's chain, or 0.
+ */
 typedef struct filedict_bucket_t {
+    unsigned long long next;
+    unsigned int lock;
+    unsigned int reserved;
+    unsigned char tags[FILEDICT_BUCKET_TAG_BYTES];
     filedict_bucket_entry_t entries[FILEDICT_BUCKET_ENTRY_COUNT];
 } filedict_bucket_t;
 
-typedef size_t (*filedict_hash_function_t)(const char *);
+typedef size_t (*filedict_hash_function_t)(const char *key, size_t key_len, unsigned long long seed);
+
+/*
+ * Every file records which of these hash functions built it, so readers always agree with writers.
+ * FILEDICT_HASH_DJB2 is 0 because files made before hash IDs existed all used djb2.
+ */
+#define FILEDICT_HASH_DJB2 0
+#define FILEDICT_HASH_WYHASH 1
+#define FILEDICT_HASH_COUNT 2
+
+#define FILEDICT_DEFAULT_HASH_SEED 0x66696c6564696374ULL
+
+/*
+ * Optional features, chosen when a file is created.
+ *
+ * FILEDICT_FEATURE_MULTI_WRITER lets several processes (or threads, each with their own filedict_t)
+ * insert into the same file at once. Writers lock the bucket they're inserting into and take an
+ * fcntl lock to grow the file. Readers never lock.
+ *
+ * FILEDICT_FEATURE_LENGTH_PREFIXED stores each entry's values with their lengths, plus a small
+ * header with the number of values and where they end. See filedict_entry_header_i.
+ *
+ * FILEDICT_FEATURE_CHAIN_FILTER gives every initial bucket a Bloom filter of the keys in its
+ * overflow buckets, so most misses stop at the initial bucket. See filedict_chain_filter.
+ *
+ * FILEDICT_FEATURE_KEY_INDEX keeps a sorted index of the keys, so filedict_prefix_scan doesn't
+ * have to look at every bucket. See filedict_key_index_t.
+ *
+ * FILEDICT_FEATURE_CHANGE_LOG records every insert in a ring, so readers can catch up on what
+ * changed with filedict_changes_since. See filedict_change_t.
+ */
+#define FILEDICT_FEATURE_MULTI_WRITER (1 << 0)
+#define FILEDICT_FEATURE_LENGTH_PREFIXED (1 << 1)
+#define FILEDICT_FEATURE_CHAIN_FILTER (1 << 2)
+#define FILEDICT_FEATURE_KEY_INDEX (1 << 3)
+#define FILEDICT_FEATURE_CHANGE_LOG (1 << 4)
+
+/*
+ * How many changes the change log of new files holds before the oldest get overwritten. Files
+ * remember the size they were made with.
+ */
+#ifndef FILEDICT_CHANGE_LOG_RECORDS
+#define FILEDICT_CHANGE_LOG_RECORDS 65536
+#endif
+
+/*
+ * How to map the file, for filedict_t.map_options. Unlike features, these aren't stored in the
+ * file: set them before each open. They're all hints, so if the kernel can't follow one (no huge
+ * pages for this file system, or RLIMIT_MEMLOCK is too low), the file still opens.
+ *
+ * FILEDICT_MAP_POPULATE faults in the whole file while mapping it, so no lookup has to.
+ * FILEDICT_MAP_WILLNEED starts reading the whole file in without waiting for it.
+ * FILEDICT_MAP_RANDOM turns off readahead, which lookups that jump around the file don't need.
+ * FILEDICT_MAP_HUGEPAGE asks for huge pages, where the file system supports them for files.
+ * FILEDICT_MAP_LOCK_BUCKETS keeps the header and initial buckets in memory, since every lookup
+ * starts there.
+ */
+#define FILEDICT_MAP_POPULATE (1 << 0)
+#define FILEDICT_MAP_WILLNEED (1 << 1)
+#define FILEDICT_MAP_RANDOM (1 << 2)
+#define FILEDICT_MAP_HUGEPAGE (1 << 3)
+#define FILEDICT_MAP_LOCK_BUCKETS (1 << 4)
+
+/*
+ * When writes get flushed to disk, for filedict_t.durability. Like map options, this isn't stored
+ * in the file.
+ *
+ * FILEDICT_DURABILITY_NONE leaves it to the kernel's writeback. filedict_commit syncs the whole file.
+ * FILEDICT_DURABILITY_PERIODIC starts writing back the pages we've changed, without waiting for
+ * them, at most every FILEDICT_SYNC_INTERVAL_MS.
+ * FILEDICT_DURABILITY_COMMIT only syncs on filedict_commit.
+ *
+ * Both of the last two keep track of the pages they've changed since the last sync, so syncing
+ * doesn't have to look at the rest of the file.
+ */
+#define FILEDICT_DURABILITY_NONE 0
+#define FILEDICT_DURABILITY_PERIODIC 1
+#define FILEDICT_DURABILITY_COMMIT 2
+
+#ifndef FILEDICT_SYNC_INTERVAL_MS
+#define FILEDICT_SYNC_INTERVAL_MS 1000
+#endif
+
+/*
+ * How many separate ranges of changed pages we keep track of. Past that, the closest two get
+ * merged, which can sync some pages that didn't change.
+ */
+#ifndef FILEDICT_DIRTY_RANGES
+#define FILEDICT_DIRTY_RANGES 32
+#endif
+
+/*
+ * The smallest key log. Logs get bigger with the index, up to a quarter of its size, so rebuilding
+ * the index stays rare.
+ */
+#ifndef FILEDICT_KEY_LOG_BYTES
+#define FILEDICT_KEY_LOG_BYTES 4096
+#endif
+
+#ifndef FILEDICT_PREFIX_SCAN_SEEN_BITS
+#define FILEDICT_PREFIX_SCAN_SEEN_BITS 4096
+#endif
+
+/*
+ * Bits in each chain filter of new files. A power of two, from 64 to 65536. Each key sets
+ * FILEDICT_CHAIN_FILTER_HASHES of them. Files remember the size they were made with.
+ */
+#ifndef FILEDICT_CHAIN_FILTER_BITS
+#define FILEDICT_CHAIN_FILTER_BITS 64
+#endif
+#define FILEDICT_CHAIN_FILTER_HASHES 3
+
+#if FILEDICT_CHAIN_FILTER_BITS < 64 || FILEDICT_CHAIN_FILTER_BITS > 65536 || (FILEDICT_CHAIN_FILTER_BITS & (FILEDICT_CHAIN_FILTER_BITS - 1))
+#error "FILEDICT_CHAIN_FILTER_BITS must be a power of two from 64 to 65536"
+#endif
+
+/*
+ * Compile with FILEDICT_STATS defined to count what each handle's lookups and inserts do. Without
+ * it, none of the counting code exists.
+ *
+ * Chain lengths are counted in buckets visited, so 1 means the key's initial bucket was enough.
+ * The last histogram slot also counts everything longer.
+ */
+#ifdef FILEDICT_STATS
+#define FILEDICT_STATS_HISTOGRAM_SIZE 16
+
+typedef struct filedict_stats_t {
+    unsigned long long gets;
+    unsigned long long get_misses;
+    unsigned long long get_chain_lengths[FILEDICT_STATS_HISTOGRAM_SIZE];
+    /* Entries whose tag matched the key's, and how many of those held some other key */
+    unsigned long long tag_matches;
+    unsigned long long tag_false_positives;
+    /* Bytes skipped over while looking for the next value */
+    unsigned long long value_bytes_scanned;
+    unsigned long long inserts;
+    unsigned long long insert_chain_lengths[FILEDICT_STATS_HISTOGRAM_SIZE];
+    unsigned long long overflow_buckets_added;
+    /* Lookups that didn't walk a chain because its filter said the key isn't there */
+    unsigned long long chain_filter_skips;
+    unsigned long long file_growths;
+    unsigned long long remaps;
+} filedict_stats_t;
+
+#define filedict_stat_add(filedict, field, n) ((filedict)->stats.field += (n))
+#define filedict_stat_histogram(filedict, field, length) \
+    ((filedict)->stats.field[(length) < FILEDICT_STATS_HISTOGRAM_SIZE ? (length) : FILEDICT_STATS_HISTOGRAM_SIZE - 1] += 1)
+#else
+#define filedict_stat_add(filedict, field, n) ((void)(n))
+#define filedict_stat_histogram(filedict, field, length) ((void)(length))
+#endif
 
 typedef struct filedict_t {
     const char *error;
@@ -27,26 +228,289 @@ typedef struct filedict_t {
     int flags;
     void *data;
     size_t data_len;
+    /* How much address space we reserved at data. The file is mapped over the start of it. */
+    size_t address_space_len;
     filedict_hash_function_t hash_function;
+    /* Set these before opening a new file. Opening an existing file takes them from its header. */
+    unsigned int hash_id;
+    unsigned long long hash_seed;
+    unsigned int features;
+    /* FILEDICT_MAP_* flags. Set these before opening any file. */
+    unsigned int map_options;
+    /* FILEDICT_DURABILITY_*. Can be changed at any time. */
+    unsigned int durability;
+    /* Pages we've changed since the last sync, as [start, end) file offsets, and when that was */
+    size_t dirty_count;
+    size_t dirty_ranges[FILEDICT_DIRTY_RANGES][2];
+    unsigned long long last_sync_ms;
+    /* The header's generation when we last mapped the whole file */
+    unsigned long long generation;
+#ifdef FILEDICT_STATS
+    filedict_stats_t stats;
+#endif
 } filedict_t;
 
-typedef struct filedict_header_t {
-    unsigned long long initial_bucket_count : 32;
-    unsigned long long hashmap_count : 32;
-} __attribute__ ((__packed__)) filedict_header_t;
+/* "FDCT" in little endian */
+#define FILEDICT_MAGIC 0x54434446
+#define FILEDICT_VERSION 5
+#define FILEDICT_HEADER_BYTES 256
+
+/*
+ * The header takes up FILEDICT_HEADER_BYTES at the start of the file. Anything we don't use yet is
+ * reserved and left as zeros, so new fields must treat 0 as "the old behavior".
+ *
+ * After the header come initial_bucket_count buckets. Everything after those is allocated by
+ * bumping data_end, which is the offset of the first unused byte in the file.
+ *
+ * file_size is how big writers have grown the file, which is usually past data_end. Writers bump
+ * generation around every change to it, seqlock style: it's odd while the file is being grown, and
+ * goes up by 2 per growth. Readers only need to remap when generation changes.
+ *
+ * In files with FILEDICT_FEATURE_CHAIN_FILTER, chain_filter_offset is where the chain filters start
+ * (one per initial bucket) and chain_filter_bits is how big each one is.
+ *
+ * In files with FILEDICT_FEATURE_KEY_INDEX, key_index_offset and key_log_offset point at the
+ * current key index and key log, or are 0 until the first key is inserted.
+ *
+ * In files with FILEDICT_FEATURE_CHANGE_LOG, change_log_offset is where the ring of
+ * change_log_records changes starts, and change_seq is how many changes were ever recorded.
+ */
+typedef union filedict_header_t {
+    struct {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int initial_bucket_count;
+        unsigned int hash_id;
+        unsigned long long hash_seed;
+        unsigned long long data_end;
+        unsigned long long overflow_bucket_count;
+        unsigned long long heap_bytes;
+        unsigned int features;
+        unsigned long long file_size;
+        unsigned long long generation;
+        unsigned long long chain_filter_offset;
+        unsigned int chain_filter_bits;
+        unsigned long long key_index_offset;
+        unsigned long long key_log_offset;
+        unsigned long long change_log_offset;
+        unsigned long long change_log_records;
+        unsigned long long change_seq;
+    };
+    unsigned char reserved[FILEDICT_HEADER_BYTES];
+} filedict_header_t;
+
+typedef char filedict_header_size_check[sizeof(filedict_header_t) == FILEDICT_HEADER_BYTES ? 1 : -1];
+
+/*
+ * Everything allocated after the initial buckets starts with one of these, so the file can be
+ * walked from start to end. "size" is the number of bytes that follow this block header.
+ */
+typedef struct filedict_block_t {
+    unsigned long long size;
+    unsigned int type;
+    unsigned int reserved;
+} filedict_block_t;
+
+#define FILEDICT_BLOCK_BUCKET 1
+#define FILEDICT_BLOCK_VALUE 2
+#define FILEDICT_BLOCK_FILTER 3
+#define FILEDICT_BLOCK_KEY_INDEX 4
+#define FILEDICT_BLOCK_KEY_LOG 5
+#define FILEDICT_BLOCK_CHANGE_LOG 6
+
+/*
+ * The key index is every key of the file, sorted. offsets are from the start of the index to each
+ * key, and the keys themselves come after the offsets.
+ *
+ * Keys inserted since the index was built are appended to the key log instead, in the order they
+ * came. When the log fills up, the next new key builds a new index out of the old one and the log,
+ * and starts an empty log. Old indexes and logs stay in the file until it's compacted.
+ *
+ * Removed keys stay in the index, and filedict_prefix_scan skips the ones without values.
+ */
+typedef struct filedict_key_index_t {
+    unsigned long long key_count;
+    unsigned long long offsets[];
+} filedict_key_index_t;
+
+typedef struct filedict_key_log_t {
+    /* Bytes of keys written to "keys" so far, and how many fit */
+    unsigned long long used;
+    unsigned long long capacity;
+    char keys[];
+} filedict_key_log_t;
+
+/*
+ * One inserted value, in the change log. Change number seq (counting from 1) goes in record
+ * (seq - 1) % change_log_records, so newer changes overwrite the oldest. The value is at index
+ * slot_i of entry entry_i of the bucket at bucket_offset.
+ *
+ * Writers claim a seq by bumping the header's change_seq, fill in the record, and set its seq
+ * last. So readers know a record is ready when its seq is the one they're looking for, and that
+ * they've fallen behind when it's bigger.
+ */
+typedef struct filedict_change_t {
+    unsigned long long seq;
+    unsigned long long bucket_offset;
+    unsigned int entry_i;
+    unsigned int slot_i;
+} filedict_change_t;
+
+/*
+ * One key/value pair for filedict_insert_batch. Only key and value need to be filled in. The rest
+ * is scratch space for filedict_insert_batch.
+ */
+typedef struct filedict_batch_item_t {
+    const char *key;
+    const char *value;
+    size_t key_hash;
+    size_t key_len;
+    size_t value_len;
+    size_t order;
+} filedict_batch_item_t;
+
+/*
+ * Decides which keys filedict_remove_if removes. Return nonzero to remove the key.
+ */
+typedef int (*filedict_remove_predicate_t)(const char *key, void *context);
 
 typedef struct filedict_read_t {
     filedict_t *filedict;
     const char *key;
+    size_t key_len;
     const char *value;
+    /* value's length, not counting the NUL byte after it */
+    size_t value_len;
+    /* Where read->value sits in the entry. Same as value, unless the value lives in the heap. */
+    const char *value_slot;
     filedict_bucket_t *bucket;
     filedict_bucket_entry_t *entry;
     size_t entry_i;
-    size_t hashmap_i;
+    size_t chain_i;
     size_t bucket_count;
     size_t key_hash;
+    unsigned char key_tag;
 } filedict_read_t;
 
+/*
+ * A cursor that visits every key/value pair in the order they sit in the file, rather than bucket
+ * chain by bucket chain like filedict_get(filedict, NULL) does. Positions are file offsets, so the
+ * file can be remapped under it.
+ */
+typedef struct filedict_scan_t {
+    filedict_t *filedict;
+    const char *key;
+    const char *value;
+    /* value's length, not counting the NUL byte after it */
+    size_t value_len;
+    /* The initial buckets this scan covers are [bucket_start, bucket_end). Only ranged scans skip any. */
+    size_t bucket_start;
+    size_t bucket_end;
+    size_t bucket_i;
+    int ranged;
+    /* Once past the initial buckets, the next block to look at and where the blocks end */
+    size_t block_offset;
+    size_t blocks_end;
+    size_t bucket_offset;
+    size_t entry_offset;
+    size_t slot_offset;
+    /* Used entries of the current bucket we haven't visited yet */
+    unsigned long long unvisited;
+} filedict_scan_t;
+
+/*
+ * A cursor over the keys that start with a prefix and their values. See filedict_prefix_scan.
+ */
+typedef struct filedict_prefix_scan_t {
+    filedict_t *filedict;
+    const char *prefix;
+    size_t prefix_len;
+    const char *key;
+    const char *value;
+    /* The values of the current key */
+    filedict_read_t read;
+    /* Where we are in the key index, then in the key log. File offsets, since the file can be remapped. */
+    size_t index_offset;
+    size_t index_i;
+    size_t log_offset;
+    size_t log_i;
+    size_t log_end;
+    /*
+     * Hashes of the keys taken from the log so far. A key can be in the log twice, and only keys
+     * that hit here need to be looked for earlier in the log.
+     */
+    unsigned long long log_seen[FILEDICT_PREFIX_SCAN_SEEN_BITS / 64];
+    /* Files without a key index get scanned whole */
+    filedict_scan_t scan;
+} filedict_prefix_scan_t;
+
+/*
+ * A cursor over the changes after some change number. See filedict_changes_since.
+ */
+typedef struct filedict_changes_t {
+    filedict_t *filedict;
+    /* The number of the current change, or of the last one we looked at once we're done */
+    unsigned long long seq;
+    const char *key;
+    const char *value;
+    /* Set when changes we hadn't seen got overwritten before we could get to them */
+    int lost;
+} filedict_changes_t;
+
+/*
+ * Frozen files are read-only snapshots of a filedict, made by ./freeze. Every key gets one record,
+ * and a minimal perfect hash takes each key straight to its record:
+ *
+ *     header | displacements (u32 each) | slots (u64 each, one per key) | records
+ *
+ * Keys are hashed with 64-bit wyhash and frozen_seed, whatever hash the file was frozen from used
+ * (that's hash_id and hash_seed). ./freeze picks a seed that gives every key a different hash.
+ *
+ * A key's hash picks one of displacement_count displacements, and the hash plus that displacement
+ * picks its slot among key_count slots (see filedict_frozen_slot). ./freeze chose the displacements
+ * so that no two keys share a slot. Keys that aren't in the file land on some other key's slot, so
+ * each slot also holds 16 bits of its key's hash above the record's offset. Most misses stop there
+ * without reading a record, and the rest compare the key.
+ *
+ * A record is a u32 value count, the key and its values, all NUL-terminated and in the order
+ * filedict_get returns them. Heap values are stored inline like any other. Records are in slot
+ * order, 4-byte aligned.
+ */
+#define FILEDICT_FROZEN_MAGIC 0x5A464446
+#define FILEDICT_FROZEN_VERSION 2
+
+typedef union filedict_frozen_header_t {
+    struct {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int hash_id;
+        unsigned long long hash_seed;
+        unsigned long long key_count;
+        unsigned long long displacement_count;
+        unsigned long long displacements_offset;
+        unsigned long long slots_offset;
+        unsigned long long records_end;
+        unsigned long long frozen_seed;
+    };
+    unsigned char reserved[FILEDICT_HEADER_BYTES];
+} filedict_frozen_header_t;
+
+typedef char filedict_frozen_header_size_check[sizeof(filedict_frozen_header_t) == FILEDICT_HEADER_BYTES ? 1 : -1];
+
+/*
+ * Like filedict_read_t, for frozen files. "key" is the key of the current value, which is only
+ * different from what was asked for when going through the whole file.
+ */
+typedef struct filedict_frozen_read_t {
+    filedict_t *filedict;
+    const char *key;
+    const char *value;
+    size_t values_left;
+    /* Only used when going through the whole file: the next record's slot */
+    size_t next_slot;
+    int all_keys;
+} filedict_frozen_read_t;
+
 #endif
 
 /*
@@ -63,13 +527,41 @@ typedef struct filedict_read_t {
 #include <errno.h>
 #include <limits.h>
 #include <assert.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+
+/*
+ * glibc only declares open file description locks with _GNU_SOURCE, which has to come before the
+ * first system header anyone includes. The kernel has had them since 3.15, so use its numbers.
+ */
+#ifndef F_OFD_SETLKW
+#define F_OFD_GETLK 36
+#define F_OFD_SETLK 37
+#define F_OFD_SETLKW 38
+#endif
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-/* This is "djb2" from http://www.cse.yorku.ca/~oz/hash.html */
-static size_t filedict_default_hash_function(const char *input) {
+/*
+ * This is "djb2" from http://www.cse.yorku.ca/~oz/hash.html
+ * It ignores the seed, since files made before seeds existed didn't have one.
+ */
+static size_t filedict_djb2_hash_function(const char *input, size_t len, unsigned long long seed) {
     unsigned long hash = 5381;
+    const char *end = input + len;
     int c;
 
-    while ((c = *input++) != 0) {
+    (void)seed;
+    while (input < end) {
+        c = *input++;
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
     }
 
@@ -77,36 +569,148 @@ static size_t filedict_default_hash_function(const char *input) {
 }
 
 /*
- * Writes at most max_len chars from src into dest.
- * Returns the string length of src.
+ * This is wyhash (https://github.com/wangyi-fudan/wyhash), reading 8 bytes at a time and mixing
+ * with 64x64->128 bit multiplies. Unaligned reads go through memcpy, which compiles to plain loads.
  */
-static size_t filedict_copy_string(char *dest, const char *src, size_t max_len) {
-    size_t src_len = 0;
-    char c;
+static const unsigned long long filedict_wyhash_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static void filedict_wyhash_mum(unsigned long long *a, unsigned long long *b) {
+    unsigned __int128 r = (unsigned __int128)*a * *b;
+    *a = (unsigned long long)r;
+    *b = (unsigned long long)(r >> 64);
+}
 
-    while (1) {
-        c = *src++;
-        if (src_len < max_len) { *dest++ = c; }
-        if (c == 0) return src_len;
-        src_len += 1;
+static unsigned long long filedict_wyhash_mix(unsigned long long a, unsigned long long b) {
+    filedict_wyhash_mum(&a, &b);
+    return a ^ b;
+}
+
+static unsigned long long filedict_wyhash_read8(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static unsigned long long filedict_wyhash_read4(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned long long filedict_wyhash64(const char *input, size_t len, unsigned long long seed) {
+    const unsigned long long *secret = filedict_wyhash_secret;
+    const unsigned char *p = (const unsigned char *)input;
+    unsigned long long a, b;
+    size_t i = len;
+
+    seed ^= filedict_wyhash_mix(seed ^ secret[0], secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (filedict_wyhash_read4(p) << 32) | filedict_wyhash_read4(p + ((len >> 3) << 2));
+            b = (filedict_wyhash_read4(p + len - 4) << 32) | filedict_wyhash_read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0) {
+            a = ((unsigned long long)p[0] << 16) | ((unsigned long long)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        if (i > 48) {
+            unsigned long long see1 = seed, see2 = seed;
+            do {
+                seed = filedict_wyhash_mix(filedict_wyhash_read8(p) ^ secret[1], filedict_wyhash_read8(p + 8) ^ seed);
+                see1 = filedict_wyhash_mix(filedict_wyhash_read8(p + 16) ^ secret[2], filedict_wyhash_read8(p + 24) ^ see1);
+                see2 = filedict_wyhash_mix(filedict_wyhash_read8(p + 32) ^ secret[3], filedict_wyhash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = filedict_wyhash_mix(filedict_wyhash_read8(p) ^ secret[1], filedict_wyhash_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = filedict_wyhash_read8(p + i - 16);
+        b = filedict_wyhash_read8(p + i - 8);
     }
 
-    return src_len;
+    a ^= secret[1];
+    b ^= seed;
+    filedict_wyhash_mum(&a, &b);
+    return filedict_wyhash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+static size_t filedict_wyhash_hash_function(const char *input, size_t len, unsigned long long seed) {
+    return (size_t)filedict_wyhash64(input, len, seed);
 }
 
+/* Indexed by hash ID */
+static const filedict_hash_function_t filedict_hash_functions[FILEDICT_HASH_COUNT] = {
+    filedict_djb2_hash_function,
+    filedict_wyhash_hash_function
+};
+
+#define filedict_hash(filedict, key) ((filedict)->hash_function((key), strlen(key), (filedict)->hash_seed))
+
+#if FILEDICT_BUCKET_ENTRY_COUNT < 64
+#define FILEDICT_BUCKET_ALL_ENTRIES ((1ULL << FILEDICT_BUCKET_ENTRY_COUNT) - 1)
+#else
+#define FILEDICT_BUCKET_ALL_ENTRIES (~0ULL)
+#endif
+
 /*
- * Returns the index of the trailing 0 when str1 and str2 have the same contents.
- * Returns 0 when str1 and str2 have different contents.
+ * Computes the tag byte for a key hash. We multiply first so that every bit of the hash has a say
+ * in the top byte (djb2 leaves the high bits of short keys at 0).
  */
-static size_t filedict_string_includes(const char *str1, const char *str2, size_t max_len) {
-    size_t i;
+static unsigned char filedict_hash_tag(size_t hash) {
+    unsigned char tag = (unsigned char)(((unsigned long long)hash * 0x9E3779B97F4A7C15ULL) >> 56);
+    return tag < FILEDICT_TAG_MIN ? tag + FILEDICT_TAG_MIN : tag;
+}
 
-    for (i = 0; i < max_len; ++i) {
-        if (str1[i] != str2[i]) return 0;
-        if (str1[i] == 0) return i;
+/*
+ * Returns a bitmask with bit i set when bucket->tags[i] == tag.
+ */
+static unsigned long long filedict_bucket_match(const filedict_bucket_t *bucket, unsigned char tag) {
+    unsigned long long mask = 0;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i needle32 = _mm256_set1_epi8((char)tag);
+    for (; i + 32 <= FILEDICT_BUCKET_TAG_BYTES; i += 32) {
+        __m256i tags = _mm256_loadu_si256((const __m256i *)&bucket->tags[i]);
+        unsigned int bits = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(tags, needle32));
+        mask |= (unsigned long long)bits << i;
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i needle16 = _mm_set1_epi8((char)tag);
+    for (; i < FILEDICT_BUCKET_TAG_BYTES; i += 16) {
+        __m128i tags = _mm_loadu_si128((const __m128i *)&bucket->tags[i]);
+        unsigned int bits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(tags, needle16));
+        mask |= (unsigned long long)bits << i;
+    }
+#else
+    for (; i < FILEDICT_BUCKET_ENTRY_COUNT; ++i) {
+        mask |= (unsigned long long)(bucket->tags[i] == tag) << i;
     }
+#endif
 
-    return 0;
+    return mask & FILEDICT_BUCKET_ALL_ENTRIES;
+}
+
+/*
+ * Returns a bitmask of the entries that hold a key, leaving out free and removed ones.
+ */
+static unsigned long long filedict_bucket_live(const filedict_bucket_t *bucket) {
+    unsigned long long dead = filedict_bucket_match(bucket, FILEDICT_TAG_EMPTY) | filedict_bucket_match(bucket, FILEDICT_TAG_REMOVED);
+    return ~dead & FILEDICT_BUCKET_ALL_ENTRIES;
 }
 
 static void filedict_init(filedict_t *filedict) {
@@ -114,16 +718,33 @@ static void filedict_init(filedict_t *filedict) {
     filedict->fd = 0;
     filedict->flags = 0;
     filedict->data_len = 0;
+    filedict->address_space_len = 0;
     filedict->data = NULL;
-    filedict->hash_function = filedict_default_hash_function;
+    filedict->hash_id = FILEDICT_HASH_WYHASH;
+    filedict->hash_seed = FILEDICT_DEFAULT_HASH_SEED;
+    filedict->hash_function = filedict_hash_functions[filedict->hash_id];
+    filedict->features = 0;
+    filedict->map_options = 0;
+    filedict->durability = FILEDICT_DURABILITY_NONE;
+    filedict->dirty_count = 0;
+    filedict->last_sync_ms = 0;
+    filedict->generation = 0;
+#ifdef FILEDICT_STATS
+    memset(&filedict->stats, 0, sizeof(filedict->stats));
+#endif
 }
 
-static void filedict_deinit(filedict_t *filedict) {
+static void filedict_unmap(filedict_t *filedict) {
     if (filedict->data) {
-        munmap(filedict->data, filedict->data_len);
+        munmap(filedict->data, filedict->address_space_len);
         filedict->data = NULL;
         filedict->data_len = 0;
+        filedict->address_space_len = 0;
     }
+}
+
+static void filedict_deinit(filedict_t *filedict) {
+    filedict_unmap(filedict);
     if (filedict->fd) {
         close(filedict->fd);
         filedict->fd = 0;
@@ -132,400 +753,2661 @@ static void filedict_deinit(filedict_t *filedict) {
 }
 
 /*
- * This computes the size of the entire filedict file given an initial bucket count and hashmap count.
+ * This computes the size of a new filedict file given its bucket count.
+ *
+ * We used to add a whole new hashmap (initially of 2x the size, later of the same size) whenever
+ * any one bucket overflowed. Realistically, most overflows are triggered by one hot key or a few
+ * ridiculously large keys, so now only the bucket that overflowed grows, by linking to a new bucket.
  */
-static size_t filedict_file_size(size_t initial_bucket_count, size_t hashmap_count) {
-    /*
-     * We used to size each additional hashmap at 2x the previous, but realistically it seems that
-     * most resizes are triggered by keys that are ridiculously large, not by mass collision.
-     *
-     * A more proper fix might be to re-structure the whole filedict. We could keep the existing
-     * hashmap structure, but with buckets that expand dynamically. This would require each bucket
-     * to contain a "pointer" to the next bucket object if present.
-     *
-     * For now, it's easiser to just keep the hashmap duplication without the size doubling.
-     */
-    return sizeof(filedict_header_t) + initial_bucket_count * hashmap_count * sizeof(filedict_bucket_t);
+static size_t filedict_file_size(size_t initial_bucket_count) {
+    return sizeof(filedict_header_t) + initial_bucket_count * sizeof(filedict_bucket_t);
 }
 
 /*
- * Resizes the filedict based on the header hashmap count and initial bucket count.
- * Naturally, your pointers into the map will become invalid after calling this.
+ * The file grows by FILEDICT_GROWTH_PERCENT of its size, and at least FILEDICT_GROWTH_BYTES past
+ * what's needed, so bursts of inserts don't have to grow it over and over.
+ *
+ * The new part is sparse, unless FILEDICT_GROWTH_FALLOCATE is defined. Then the filesystem allocates
+ * it right away, which keeps the file's extents together but takes up the disk space immediately.
  */
-static void filedict_resize(filedict_t *filedict) {
-    filedict_header_t *header = (filedict_header_t*)filedict->data;
-    size_t computed_size = filedict_file_size(header->initial_bucket_count, header->hashmap_count);
-    if (computed_size <= filedict->data_len) return;
+#ifndef FILEDICT_GROWTH_BYTES
+#define FILEDICT_GROWTH_BYTES (16 * sizeof(filedict_bucket_t))
+#endif
 
-    munmap(filedict->data, filedict->data_len);
-    filedict->data = mmap(
-        filedict->data,
-        computed_size,
-        PROT_READ | ((filedict->flags & O_RDWR) ? PROT_WRITE : 0),
-        MAP_SHARED,
-        filedict->fd,
-        0
-    );
-    if (filedict->data == MAP_FAILED) { filedict->error = strerror(errno); return; }
-    filedict->data_len = computed_size;
-}
+#ifndef FILEDICT_GROWTH_PERCENT
+#define FILEDICT_GROWTH_PERCENT 25
+#endif
 
 /*
- * This opens a new file for reading and writing, optionally letting you specify the initial bucket count.
+ * We reserve this much address space up front and map the file over the start of it, so that
+ * growing the mapping never has to move it. It's only address space: nothing is allocated for it.
  */
-#define filedict_open_new(filedict, filename) \
-    filedict_open_f(filedict, filename, O_CREAT | O_TRUNC | O_RDWR, 4096)
+#ifndef FILEDICT_ADDRESS_SPACE_BYTES
+#define FILEDICT_ADDRESS_SPACE_BYTES ((size_t)1 << (sizeof(void *) >= 8 ? 36 : 28))
+#endif
 
-#define filedict_open_readonly(filedict, filename) \
-    filedict_open_f(filedict, filename, O_RDONLY, 4096)
+/*
+ * Applies map_options to the part of the mapping from start (page aligned) to end. Only bytes
+ * before locked_end are locked.
+ */
+static void filedict_apply_map_options(filedict_t *filedict, size_t start, size_t end, size_t locked_end) {
+    char *data = (char *)filedict->data;
+    unsigned int options = filedict->map_options;
+
+    if (start >= end) return;
+    if (options & FILEDICT_MAP_WILLNEED) madvise(data + start, end - start, MADV_WILLNEED);
+    if (options & FILEDICT_MAP_RANDOM) madvise(data + start, end - start, MADV_RANDOM);
+#ifdef MADV_HUGEPAGE
+    if (options & FILEDICT_MAP_HUGEPAGE) madvise(data + start, end - start, MADV_HUGEPAGE);
+#endif
+    if ((options & FILEDICT_MAP_LOCK_BUCKETS) && start < locked_end) {
+        mlock(data + start, (locked_end < end ? locked_end : end) - start);
+    }
+}
 
-#define filedict_open(filedict, filename) \
-    filedict_open_f(filedict, filename, O_CREAT | O_RDWR, 4096)
+/*
+ * Maps the first new_len bytes of the file. Usually this only maps the part past what we already
+ * had, right after it, so data stays where it is and pointers into the map stay valid.
+ *
+ * Only when the file outgrows the address space we reserved do we have to start over somewhere
+ * else, which invalidates pointers into the map.
+ */
+static void filedict_remap(filedict_t *filedict, size_t new_len) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped_from = 0, address_space_len;
+    void *base;
 
-static void filedict_open_f(
-    filedict_t *filedict,
-    const char *filename,
-    int flags,
-    unsigned int initial_bucket_count
-) {
-    struct stat info;
+    if (filedict->data != NULL && new_len <= filedict->data_len) return;
+    filedict_stat_add(filedict, remaps, 1);
 
-    filedict->flags = flags;
-    filedict->fd = open(filename, flags, 0666);
-    if (filedict->fd == -1) { filedict->error = strerror(errno); return; }
-    if (fstat(filedict->fd, &info) != 0) { filedict->error = strerror(errno); return; }
+    if (filedict->data != NULL && new_len <= filedict->address_space_len) {
+        /* Mappings have to start at a page boundary, so remap the partial page at the end too */
+        mapped_from = filedict->data_len & ~(page_size - 1);
+    }
+    else {
+        for (address_space_len = FILEDICT_ADDRESS_SPACE_BYTES; address_space_len < new_len; address_space_len *= 2);
 
-    if (info.st_size == 0 && (flags & O_RDWR)) {
-        filedict->data_len = filedict_file_size(initial_bucket_count, 1);
-        ftruncate(filedict->fd, filedict->data_len);
-    } else {
-        filedict->data_len = info.st_size;
+        filedict_unmap(filedict);
+        base = mmap(NULL, address_space_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            filedict->error = strerror(errno);
+            return;
+        }
+        filedict->data = base;
+        filedict->address_space_len = address_space_len;
     }
 
-    filedict->data = mmap(
-        NULL,
-        filedict->data_len,
-        PROT_READ | ((flags & O_RDWR) ? PROT_WRITE : 0),
-        MAP_SHARED,
+    base = mmap(
+        (char *)filedict->data + mapped_from,
+        new_len - mapped_from,
+        PROT_READ | ((filedict->flags & O_RDWR) ? PROT_WRITE : 0),
+        MAP_SHARED | MAP_FIXED | ((filedict->map_options & FILEDICT_MAP_POPULATE) ? MAP_POPULATE : 0),
         filedict->fd,
-        0
+        mapped_from
     );
-    if (filedict->data == MAP_FAILED) { filedict->error = strerror(errno); return; }
-
-    filedict_header_t *data = (filedict_header_t *)filedict->data;
-    assert(initial_bucket_count <= UINT_MAX);
-
-    if (data->initial_bucket_count == 0) {
-        data->initial_bucket_count = initial_bucket_count;
-        data->hashmap_count = 1;
+    if (base == MAP_FAILED) {
+        filedict->error = strerror(errno);
+        filedict_unmap(filedict);
+        return;
     }
+    filedict->data_len = new_len;
+
+    /* Before the file has a header, this only locks the header. filedict_open_f does the rest. */
+    filedict_apply_map_options(
+        filedict,
+        mapped_from,
+        new_len,
+        filedict_file_size(((filedict_header_t *)filedict->data)->initial_bucket_count)
+    );
 }
 
 /*
- * Inserts a new value under "key". Filedict keys have multiple values, so this will "append" a new
- * value onto the end of the entry.
+ * Resizes the mapping to cover everything allocated in the file, which may have grown since we
+ * mapped it (possibly by another process). Use this when you've found an offset past the end of the
+ * mapping. Otherwise, filedict_refresh is cheaper.
+ * Your pointers into the map stay valid, unless the file outgrew FILEDICT_ADDRESS_SPACE_BYTES.
  */
-#define filedict_insert(filedict, key, value) filedict_insert_f(filedict, key, value, 0)
-#define filedict_insert_unique(filedict, key, value) filedict_insert_f(filedict, key, value, 1)
+static void filedict_resize(filedict_t *filedict) {
+    filedict_header_t *header = (filedict_header_t*)filedict->data;
+    size_t computed_size = __atomic_load_n(&header->data_end, __ATOMIC_ACQUIRE);
+    if (computed_size <= filedict->data_len) return;
 
-static void filedict_insert_f(filedict_t *filedict, const char *key, const char *value, int unique) {
-    assert(filedict->fd != 0);
-    assert(filedict->data != NULL);
+    filedict_remap(filedict, computed_size);
+}
 
-    size_t i, hashmap_i = 0, bucket_count, key_hash;
+/*
+ * Brings our mapping up to date with the whole file if another writer has grown it since we last
+ * looked. This only reads the header, so it's cheap enough to call before every operation.
+ *
+ * Returns 1 if we had to remap, 0 otherwise. See filedict_remap for when that moves the map.
+ */
+static int filedict_refresh(filedict_t *filedict) {
     filedict_header_t *header = (filedict_header_t *)filedict->data;
-    filedict_bucket_t *hashmap = filedict->data + sizeof(filedict_header_t);
+    unsigned long long generation, file_size;
+
+    while (1) {
+        generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+        if (generation == filedict->generation) return 0;
+
+        /*
+         * Someone is growing the file right now. What we have mapped is still valid, and nothing
+         * past it is in use until they're done, so we'll catch up next time.
+         */
+        if (generation & 1) return 0;
+
+        file_size = __atomic_load_n(&header->file_size, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->generation, __ATOMIC_RELAXED) == generation) break;
+    }
+
+    if (file_size <= filedict->data_len) {
+        filedict->generation = generation;
+        return 0;
+    }
+
+    filedict_remap(filedict, file_size);
+    if (filedict->error) return 0;
+
+    filedict->generation = generation;
+    return 1;
+}
+
+/*
+ * Takes (or releases) one of the fcntl locks that writers of files with FILEDICT_FEATURE_MULTI_WRITER
+ * use for changes that aren't to a single bucket. Each lock is a different byte of the file.
+ * Open file description locks belong to our file descriptor rather than to our process, so this
+ * works between threads too. Where those don't exist, this falls back to classic POSIX locks, which
+ * belong to the process, so only separate processes can share a file there.
+ */
+#define FILEDICT_LOCK_GROWTH 0
+#define FILEDICT_LOCK_KEY_INDEX 1
+
+#define filedict_lock_growth(filedict, type) filedict_lock_file((filedict), FILEDICT_LOCK_GROWTH, (type))
+
+static void filedict_lock_file(filedict_t *filedict, off_t lock_byte, short type) {
+    struct flock lock;
+#ifdef F_OFD_SETLKW
+    int result;
+#endif
+
+    if (!(filedict->features & FILEDICT_FEATURE_MULTI_WRITER)) return;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = lock_byte;
+    lock.l_len = 1;
+
+#ifdef F_OFD_SETLKW
+    while ((result = fcntl(filedict->fd, F_OFD_SETLKW, &lock)) == -1 && errno == EINTR);
+    /* Only kernels that are too old to have them say EINVAL */
+    if (result == 0 || errno != EINVAL) return;
+#endif
+    while (fcntl(filedict->fd, F_SETLKW, &lock) == -1 && errno == EINTR);
+}
+
+/*
+ * Makes sure the file and our mapping have room for at least size more bytes after data_end, so
+ * the next allocations that fit in it won't have to remap.
+ * Like filedict_resize, this can move the map if the file outgrows its address space.
+ */
+static void filedict_reserve(filedict_t *filedict, size_t size) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    size_t needed = __atomic_load_n(&header->data_end, __ATOMIC_ACQUIRE) + size;
+    unsigned long long generation;
+    struct stat info;
+
+    if (needed > filedict->data_len) {
+        filedict_lock_growth(filedict, F_WRLCK);
+
+        if (fstat(filedict->fd, &info) != 0) {
+            filedict->error = strerror(errno);
+            filedict_lock_growth(filedict, F_UNLCK);
+            return;
+        }
+
+        /* Someone else may have grown the file already. Never shrink it out from under them. */
+        if ((size_t)info.st_size < needed) {
+            size_t new_file_size = info.st_size + info.st_size / 100 * FILEDICT_GROWTH_PERCENT;
+            int grew;
+
+            if (new_file_size < needed + FILEDICT_GROWTH_BYTES) new_file_size = needed + FILEDICT_GROWTH_BYTES;
+
+            generation = __atomic_load_n(&header->generation, __ATOMIC_RELAXED);
+            __atomic_store_n(&header->generation, generation + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+
+#ifdef FILEDICT_GROWTH_FALLOCATE
+            errno = posix_fallocate(filedict->fd, info.st_size, new_file_size - info.st_size);
+            grew = errno == 0;
+#else
+            grew = ftruncate(filedict->fd, new_file_size) == 0;
+#endif
+            filedict_stat_add(filedict, file_growths, grew);
+            if (grew) __atomic_store_n(&header->file_size, new_file_size, __ATOMIC_RELAXED);
+            else filedict->error = strerror(errno);
+
+            __atomic_store_n(&header->generation, generation + 2, __ATOMIC_RELEASE);
+            filedict_lock_growth(filedict, F_UNLCK);
+            if (!grew) return;
+
+            filedict_remap(filedict, new_file_size);
+            if (!filedict->error) filedict->generation = generation + 2;
+            return;
+        }
+
+        filedict_lock_growth(filedict, F_UNLCK);
+        filedict_remap(filedict, info.st_size);
+    }
+}
+
+/*
+ * Remembers that we changed len bytes at "at", so the next sync covers them.
+ */
+static void filedict_mark_dirty(filedict_t *filedict, const void *at, size_t len) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE), start, end, i, closest = 0, gap, closest_gap = (size_t)-1;
+
+    if (filedict->durability == FILEDICT_DURABILITY_NONE || len == 0) return;
+
+    start = ((const char *)at - (char *)filedict->data) & ~(page_size - 1);
+    end = ((const char *)at - (char *)filedict->data + len + page_size - 1) & ~(page_size - 1);
+
+    /* Writes mostly land where earlier ones did: the header, a bucket, the end of the file */
+    for (i = 0; i < filedict->dirty_count; ++i) {
+        if (start <= filedict->dirty_ranges[i][1] && end >= filedict->dirty_ranges[i][0]) {
+            if (start < filedict->dirty_ranges[i][0]) filedict->dirty_ranges[i][0] = start;
+            if (end > filedict->dirty_ranges[i][1]) filedict->dirty_ranges[i][1] = end;
+            return;
+        }
+    }
+
+    if (filedict->dirty_count < FILEDICT_DIRTY_RANGES) {
+        filedict->dirty_ranges[filedict->dirty_count][0] = start;
+        filedict->dirty_ranges[filedict->dirty_count][1] = end;
+        filedict->dirty_count += 1;
+        return;
+    }
+
+    for (i = 0; i < filedict->dirty_count; ++i) {
+        gap = start > filedict->dirty_ranges[i][1] ? start - filedict->dirty_ranges[i][1] : filedict->dirty_ranges[i][0] - end;
+        if (gap < closest_gap) {
+            closest = i;
+            closest_gap = gap;
+        }
+    }
+    if (start < filedict->dirty_ranges[closest][0]) filedict->dirty_ranges[closest][0] = start;
+    if (end > filedict->dirty_ranges[closest][1]) filedict->dirty_ranges[closest][1] = end;
+}
+
+static unsigned long long filedict_now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000 + (unsigned long long)now.tv_nsec / 1000000;
+}
+
+/*
+ * msyncs the pages we've changed since the last sync with the given flags (MS_SYNC or MS_ASYNC).
+ * The header goes last, so once it's on disk, everything it points at is too.
+ */
+static void filedict_sync_dirty(filedict_t *filedict, int flags) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE), i, start, end;
+    int header_dirty = 0;
+
+    for (i = 0; i < filedict->dirty_count && filedict->error == NULL; ++i) {
+        start = filedict->dirty_ranges[i][0];
+        end = filedict->dirty_ranges[i][1];
+        if (end > filedict->data_len) end = filedict->data_len;
+
+        if (start == 0) {
+            header_dirty = 1;
+            start = page_size;
+        }
+        if (start < end && msync((char *)filedict->data + start, end - start, flags) != 0) {
+            filedict->error = strerror(errno);
+        }
+    }
+    if (header_dirty && filedict->error == NULL && msync(filedict->data, page_size, flags) != 0) {
+        filedict->error = strerror(errno);
+    }
+
+    filedict->dirty_count = 0;
+    filedict->last_sync_ms = filedict_now_ms();
+}
+
+/*
+ * Called after every change we make, so FILEDICT_DURABILITY_PERIODIC can start writing back once
+ * enough time has passed.
+ */
+static void filedict_after_write(filedict_t *filedict) {
+    if (filedict->durability != FILEDICT_DURABILITY_PERIODIC || filedict->dirty_count == 0) return;
+    if (filedict_now_ms() - filedict->last_sync_ms < FILEDICT_SYNC_INTERVAL_MS) return;
+
+    filedict_sync_dirty(filedict, MS_ASYNC);
+}
+
+/*
+ * Makes everything this filedict_t has written so far durable, and returns once it's on disk.
+ * With FILEDICT_DURABILITY_NONE, we don't know what changed, so this syncs the whole file.
+ *
+ * Only covers this filedict_t's own writes. Other writers to the same file commit theirs.
+ */
+static void filedict_commit(filedict_t *filedict) {
+    if (filedict->error) return;
+
+    if (filedict->durability == FILEDICT_DURABILITY_NONE) {
+        if (msync(filedict->data, filedict->data_len, MS_SYNC) != 0) filedict->error = strerror(errno);
+        return;
+    }
+    filedict_sync_dirty(filedict, MS_SYNC);
+}
+
+/*
+ * Allocates a block of the given type with room for size bytes at the end of the file, growing it
+ * if needed. Returns the file offset of the space after the block header, or 0 with
+ * filedict->error set if we couldn't grow.
+ * Like filedict_resize, this can move the map if the file outgrows its address space.
+ */
+static size_t filedict_alloc(filedict_t *filedict, unsigned int type, size_t size) {
+    filedict_header_t *header;
+    filedict_block_t *block;
+    unsigned long long offset;
+    /* Keep every block 8-byte aligned */
+    size_t block_size = (size + 7) & ~(size_t)7;
+
+    /*
+     * Other writers may be allocating at the same time, so we claim our space by moving data_end
+     * with a compare-and-swap. The file is always grown before data_end moves past its end.
+     */
+    while (1) {
+        filedict_reserve(filedict, sizeof(filedict_block_t) + block_size);
+        if (filedict->error) return 0;
+
+        header = (filedict_header_t *)filedict->data;
+        offset = __atomic_load_n(&header->data_end, __ATOMIC_ACQUIRE);
+        if (offset + sizeof(filedict_block_t) + block_size > filedict->data_len) continue;
+
+        if (__atomic_compare_exchange_n(
+            &header->data_end,
+            &offset,
+            offset + sizeof(filedict_block_t) + block_size,
+            0,
+            __ATOMIC_ACQ_REL,
+            __ATOMIC_ACQUIRE
+        )) break;
+    }
+
+    block = (filedict_block_t *)((char *)filedict->data + offset);
+    block->type = type;
+    __atomic_store_n(&block->size, block_size, __ATOMIC_RELEASE);
+    filedict_mark_dirty(filedict, header, sizeof(filedict_header_t));
+    filedict_mark_dirty(filedict, block, sizeof(filedict_block_t));
+    return offset + sizeof(filedict_block_t);
+}
+
+/*
+ * Chain filters are Bloom filters of the keys that have entries in a chain's overflow buckets. Keys
+ * in the initial bucket don't need to be in them, since lookups look at that bucket anyway.
+ *
+ * Filters only ever gain bits. Removed keys keep theirs until the file is compacted. A chain with
+ * many more keys than its filter has bits fills its filter up, which then lets every lookup through.
+ *
+ * Returns the filter for the chain key_hash goes into, or NULL if the file doesn't have filters.
+ */
+static unsigned long long *filedict_chain_filter(filedict_t *filedict, size_t key_hash) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    size_t filter_offset = __atomic_load_n(&header->chain_filter_offset, __ATOMIC_ACQUIRE);
+
+    if (filter_offset == 0) return NULL;
+    return (unsigned long long *)((char *)filedict->data + filter_offset) +
+        (key_hash % header->initial_bucket_count) * (header->chain_filter_bits / 64);
+}
+
+/*
+ * The i-th bit a key sets in its chain's filter. The low bits of the hash already picked the
+ * bucket and the tag, so these come from the high bits of the hash scrambled.
+ */
+#define filedict_chain_filter_bit(key_hash, i, bits) \
+    ((((unsigned long long)(key_hash) * 0x9E3779B97F4A7C15ULL) >> (16 * (i) + 16)) & ((bits) - 1))
+
+/*
+ * Adds a key to its chain's filter. Has to happen before the key's entry is visible in an overflow
+ * bucket, so readers never skip a chain that has the key.
+ */
+static void filedict_chain_filter_add(filedict_t *filedict, size_t key_hash) {
+    unsigned long long *filter = filedict_chain_filter(filedict, key_hash), bit;
+    unsigned int bits, i;
+
+    if (filter == NULL) return;
+    bits = ((filedict_header_t *)filedict->data)->chain_filter_bits;
+
+    for (i = 0; i < FILEDICT_CHAIN_FILTER_HASHES; ++i) {
+        bit = filedict_chain_filter_bit(key_hash, i, bits);
+        /* Most keys' bits are set already. Don't dirty the page for those. */
+        if (filter[bit / 64] & (1ULL << (bit % 64))) continue;
+        __atomic_fetch_or(&filter[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELEASE);
+        filedict_mark_dirty(filedict, &filter[bit / 64], sizeof(filter[0]));
+    }
+}
+
+/*
+ * Returns 0 when the key is definitely not in the overflow buckets of its chain.
+ */
+static int filedict_chain_filter_has(filedict_t *filedict, size_t key_hash) {
+    unsigned long long *filter = filedict_chain_filter(filedict, key_hash), bit;
+    unsigned int bits, i;
+
+    if (filter == NULL) return 1;
+    bits = ((filedict_header_t *)filedict->data)->chain_filter_bits;
+
+    for (i = 0; i < FILEDICT_CHAIN_FILTER_HASHES; ++i) {
+        bit = filedict_chain_filter_bit(key_hash, i, bits);
+        if (!(__atomic_load_n(&filter[bit / 64], __ATOMIC_ACQUIRE) & (1ULL << (bit % 64)))) return 0;
+    }
+    return 1;
+}
+
+#define filedict_key_index_at(filedict, offset) ((filedict_key_index_t *)((char *)(filedict)->data + (offset)))
+#define filedict_key_log_at(filedict, offset) ((filedict_key_log_t *)((char *)(filedict)->data + (offset)))
+#define filedict_key_index_key(index, i) ((const char *)(index) + (index)->offsets[i])
+
+static void filedict_key_index_sift_down(const char *base, unsigned long long *offsets, size_t root, size_t count) {
+    unsigned long long swap;
+    size_t child;
+
+    while ((child = root * 2 + 1) < count) {
+        if (child + 1 < count && strcmp(base + offsets[child], base + offsets[child + 1]) < 0) child += 1;
+        if (strcmp(base + offsets[root], base + offsets[child]) >= 0) return;
+
+        swap = offsets[root];
+        offsets[root] = offsets[child];
+        offsets[child] = swap;
+        root = child;
+    }
+}
+
+/*
+ * Heapsorts count offsets by the keys they point at (from base).
+ */
+static void filedict_key_index_sort(const char *base, unsigned long long *offsets, size_t count) {
+    unsigned long long swap;
+    size_t i;
+
+    for (i = count / 2; i > 0; --i) {
+        filedict_key_index_sift_down(base, offsets, i - 1, count);
+    }
+    for (i = count; i > 1; --i) {
+        swap = offsets[0];
+        offsets[0] = offsets[i - 1];
+        offsets[i - 1] = swap;
+        filedict_key_index_sift_down(base, offsets, 0, i - 1);
+    }
+}
+
+/*
+ * Returns the position of the first key in the index that isn't less than key.
+ */
+static size_t filedict_key_index_lower_bound(filedict_key_index_t *index, const char *key) {
+    size_t low = 0, high = index->key_count, middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (strcmp(filedict_key_index_key(index, middle), key) < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/*
+ * Builds a new key index out of the current one, the key log and key, and starts a new key log.
+ */
+static void filedict_key_index_rebuild(filedict_t *filedict, const char *key, size_t key_len) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    size_t index_offset = header->key_index_offset, log_offset = header->key_log_offset;
+    size_t key_count = 1, key_bytes = key_len + 1, log_capacity, new_index_offset, new_log_offset;
+    size_t i, pos, len, keys_start, sorted_count = 0, new_i, unique;
+    unsigned long long *offsets, next;
+    filedict_key_index_t *index, *new_index;
+    filedict_key_log_t *log;
+
+    if (index_offset != 0) {
+        index = filedict_key_index_at(filedict, index_offset);
+        key_count += index->key_count;
+        for (i = 0; i < index->key_count; ++i) key_bytes += strlen(filedict_key_index_key(index, i)) + 1;
+    }
+    if (log_offset != 0) {
+        log = filedict_key_log_at(filedict, log_offset);
+        for (pos = 0; pos < log->used; pos += strlen(&log->keys[pos]) + 1) key_count += 1;
+        key_bytes += log->used;
+    }
+
+    new_index_offset = filedict_alloc(
+        filedict,
+        FILEDICT_BLOCK_KEY_INDEX,
+        sizeof(filedict_key_index_t) + key_count * sizeof(unsigned long long) + key_bytes
+    );
+    if (new_index_offset == 0) return;
+
+    /*
+     * Rebuilding is linear in the size of the index, and prefix scans go through the whole log.
+     * A log a quarter the size of the index keeps both in check, and the old indexes left behind
+     * add up to about 4 times the size of the current one.
+     */
+    log_capacity = key_bytes / 4;
+    if (log_capacity < FILEDICT_KEY_LOG_BYTES) log_capacity = FILEDICT_KEY_LOG_BYTES;
+    new_log_offset = filedict_alloc(filedict, FILEDICT_BLOCK_KEY_LOG, sizeof(filedict_key_log_t) + log_capacity);
+    if (new_log_offset == 0) return;
+
+    /* Allocating might have remapped, so everything is looked up again from here */
+    new_index = filedict_key_index_at(filedict, new_index_offset);
+    new_index->key_count = 0;
+    keys_start = pos = sizeof(filedict_key_index_t) + key_count * sizeof(unsigned long long);
+
+#define filedict_key_index_append(append_key, append_len) do { \
+        memcpy((char *)new_index + pos, (append_key), (append_len)); \
+        ((char *)new_index)[pos + (append_len)] = 0; \
+        pos += (append_len) + 1; \
+    } while (0)
+
+    /* The old index's keys go first, still sorted. Their offsets get filled in by the merge. */
+    if (index_offset != 0) {
+        index = filedict_key_index_at(filedict, index_offset);
+        for (i = 0; i < index->key_count; ++i) {
+            len = strlen(filedict_key_index_key(index, i));
+            filedict_key_index_append(filedict_key_index_key(index, i), len);
+        }
+        sorted_count = index->key_count;
+    }
+    new_index->key_count = sorted_count;
+    if (log_offset != 0) {
+        log = filedict_key_log_at(filedict, log_offset);
+        for (i = 0; i < log->used; i += len + 1) {
+            len = strlen(&log->keys[i]);
+            new_index->offsets[new_index->key_count++] = pos;
+            filedict_key_index_append(&log->keys[i], len);
+        }
+    }
+    new_index->offsets[new_index->key_count++] = pos;
+    filedict_key_index_append(key, key_len);
+#undef filedict_key_index_append
+
+    /*
+     * Only the new keys need sorting. Merging them in front to back never writes over a new key's
+     * offset before it's been read, since each step writes at most one slot past what it read.
+     */
+    offsets = new_index->offsets;
+    filedict_key_index_sort((const char *)new_index, &offsets[sorted_count], key_count - sorted_count);
+    for (i = 0, unique = 0, new_i = sorted_count, pos = keys_start; i < sorted_count || new_i < key_count;) {
+        if (i < sorted_count && (new_i == key_count || strcmp((char *)new_index + pos, (char *)new_index + offsets[new_i]) <= 0)) {
+            next = pos;
+            pos += strlen((char *)new_index + pos) + 1;
+            i += 1;
+        }
+        else {
+            next = offsets[new_i++];
+        }
+        /* A key that was removed and inserted again can be in there twice */
+        if (unique > 0 && strcmp((char *)new_index + offsets[unique - 1], (char *)new_index + next) == 0) continue;
+        offsets[unique++] = next;
+    }
+    new_index->key_count = unique;
+
+    log = filedict_key_log_at(filedict, new_log_offset);
+    log->used = 0;
+    log->capacity = log_capacity;
+    filedict_mark_dirty(filedict, new_index, pos);
+    filedict_mark_dirty(filedict, log, sizeof(filedict_key_log_t));
+
+    /*
+     * The index goes first. A prefix scan that gets the new log also gets the new index, and one
+     * that gets the old log with the new index only sees some keys twice, which it checks for.
+     */
+    header = (filedict_header_t *)filedict->data;
+    __atomic_store_n(&header->key_index_offset, new_index_offset, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->key_log_offset, new_log_offset, __ATOMIC_RELEASE);
+    filedict_mark_dirty(filedict, header, sizeof(filedict_header_t));
+}
+
+/*
+ * Adds a key that's new to the file to the key log, or rebuilds the index when the log is full.
+ */
+static void filedict_key_index_add(filedict_t *filedict, const char *key, size_t key_len) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_key_log_t *log;
+    size_t log_offset;
+
+    if (!(filedict->features & FILEDICT_FEATURE_KEY_INDEX)) return;
+    filedict_lock_file(filedict, FILEDICT_LOCK_KEY_INDEX, F_WRLCK);
+
+    log_offset = __atomic_load_n(&header->key_log_offset, __ATOMIC_ACQUIRE);
+    log = filedict_key_log_at(filedict, log_offset);
+
+    if (log_offset != 0 && log->used + key_len + 1 <= log->capacity) {
+        memcpy(&log->keys[log->used], key, key_len);
+        log->keys[log->used + key_len] = 0;
+        filedict_mark_dirty(filedict, &log->keys[log->used], key_len + 1);
+        __atomic_store_n(&log->used, log->used + key_len + 1, __ATOMIC_RELEASE);
+        filedict_mark_dirty(filedict, &log->used, sizeof(log->used));
+    }
+    else {
+        filedict_key_index_rebuild(filedict, key, key_len);
+    }
+
+    filedict_lock_file(filedict, FILEDICT_LOCK_KEY_INDEX, F_UNLCK);
+}
+
+static unsigned int filedict_thread_id(void) {
+#ifdef __linux__
+    return (unsigned int)syscall(SYS_gettid);
+#else
+    return (unsigned int)getpid();
+#endif
+}
+
+/*
+ * Locks the chain of the initial bucket at bucket_i against other writers, for files with
+ * FILEDICT_FEATURE_MULTI_WRITER. Writers hold this only while inserting, so we spin and then yield.
+ * If the lock's owner has died without releasing it, we take the lock over.
+ */
+static void filedict_lock_bucket(filedict_t *filedict, size_t bucket_i) {
+    unsigned int self, owner = 0;
+    unsigned long spins = 0;
+    unsigned int *lock;
+
+    if (!(filedict->features & FILEDICT_FEATURE_MULTI_WRITER)) return;
+
+    self = filedict_thread_id();
+    lock = &((filedict_bucket_t *)((char *)filedict->data + sizeof(filedict_header_t)))[bucket_i].lock;
+
+    while (!__atomic_compare_exchange_n(lock, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (++spins % 1024 == 0) {
+            if (kill((pid_t)owner, 0) == -1 && errno == ESRCH) {
+                if (__atomic_compare_exchange_n(lock, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                    return;
+                }
+            }
+            sched_yield();
+        }
+        owner = 0;
+    }
+}
+
+static void filedict_unlock_bucket(filedict_t *filedict, size_t bucket_i) {
+    unsigned int *lock;
+
+    if (!(filedict->features & FILEDICT_FEATURE_MULTI_WRITER)) return;
+
+    lock = &((filedict_bucket_t *)((char *)filedict->data + sizeof(filedict_header_t)))[bucket_i].lock;
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the bucket at the given file offset, remapping first if it's past what we have mapped.
+ * Returns NULL with filedict->error set if the bucket isn't in the file.
+ */
+static filedict_bucket_t *filedict_bucket_at(filedict_t *filedict, size_t offset) {
+    if (offset + sizeof(filedict_bucket_t) > filedict->data_len) {
+        filedict_resize(filedict);
+        if (filedict->error) return NULL;
+
+        if (offset + sizeof(filedict_bucket_t) > filedict->data_len) {
+            filedict->error = "Overflow bucket is past the end of the file";
+            return NULL;
+        }
+    }
+    return (filedict_bucket_t *)((char *)filedict->data + offset);
+}
+
+#define filedict_buckets(filedict) ((filedict_bucket_t *)((char *)(filedict)->data + sizeof(filedict_header_t)))
+
+static void filedict_encode_heap_ref(char *dest, size_t offset) {
+    size_t i;
+
+    dest[0] = (char)FILEDICT_HEAP_MARKER;
+    for (i = 1; i < FILEDICT_HEAP_REF_BYTES; ++i) {
+        dest[i] = (char)(0x80 | (offset & 0x7F));
+        offset >>= 7;
+    }
+}
+
+static size_t filedict_decode_heap_ref(const char *src) {
+    size_t i, offset = 0;
+
+    for (i = FILEDICT_HEAP_REF_BYTES - 1; i > 0; --i) {
+        offset = (offset << 7) | ((unsigned char)src[i] & 0x7F);
+    }
+    return offset;
+}
+
+#define filedict_is_heap_ref(slot) ((unsigned char)(slot)[0] == FILEDICT_HEAP_MARKER)
+
+/*
+ * Returns the heap value at the given file offset, or NULL if it isn't (entirely) mapped.
+ */
+static const char *filedict_heap_value_at(filedict_t *filedict, size_t offset) {
+    filedict_block_t *block;
+
+    if (offset < sizeof(filedict_block_t) || offset > filedict->data_len) return NULL;
+
+    block = (filedict_block_t *)((char *)filedict->data + offset - sizeof(filedict_block_t));
+    if (offset + block->size > filedict->data_len) return NULL;
+
+    return (const char *)block + sizeof(filedict_block_t);
+}
+
+/*
+ * Takes a value as stored in an entry and returns the actual value, following heap references.
+ * Returns NULL if the value is in a part of the heap we haven't mapped.
+ */
+static const char *filedict_resolve_value(filedict_t *filedict, const char *slot) {
+    if (!filedict_is_heap_ref(slot)) return slot;
+    return filedict_heap_value_at(filedict, filedict_decode_heap_ref(slot));
+}
+
+/*
+ * This opens a new file for reading and writing, optionally letting you specify the initial bucket count.
+ */
+#define filedict_open_new(filedict, filename) \
+    filedict_open_f(filedict, filename, O_CREAT | O_TRUNC | O_RDWR, 4096)
+
+#define filedict_open_readonly(filedict, filename) \
+    filedict_open_f(filedict, filename, O_RDONLY, 4096)
+
+#define filedict_open(filedict, filename) \
+    filedict_open_f(filedict, filename, O_CREAT | O_RDWR, 4096)
+
+static void filedict_open_f(
+    filedict_t *filedict,
+    const char *filename,
+    int flags,
+    unsigned int initial_bucket_count
+) {
+    struct stat info;
+    size_t filter_offset, change_log_offset;
+    int created = 0;
+
+    filedict->flags = flags;
+    filedict->fd = open(filename, flags, 0666);
+    if (filedict->fd == -1) { filedict->error = strerror(errno); return; }
+    if (fstat(filedict->fd, &info) != 0) { filedict->error = strerror(errno); return; }
+
+    if (info.st_size == 0 && (flags & O_RDWR)) {
+        filedict->data_len = filedict_file_size(initial_bucket_count);
+        ftruncate(filedict->fd, filedict->data_len);
+    } else {
+        filedict->data_len = info.st_size;
+        if (filedict->data_len < sizeof(filedict_header_t)) {
+            filedict->error = "Not a filedict file (too small)";
+            return;
+        }
+    }
+
+    filedict_remap(filedict, filedict->data_len);
+    if (filedict->error) return;
+
+    filedict_header_t *data = (filedict_header_t *)filedict->data;
+    assert(initial_bucket_count <= UINT_MAX);
+
+    if (data->magic == 0 && data->initial_bucket_count == 0 && (flags & O_RDWR)) {
+        data->magic = FILEDICT_MAGIC;
+        data->version = FILEDICT_VERSION;
+        data->initial_bucket_count = initial_bucket_count;
+        data->data_end = filedict->data_len;
+        data->file_size = filedict->data_len;
+        data->generation = 0;
+        data->overflow_bucket_count = 0;
+        data->heap_bytes = 0;
+        data->features = filedict->features;
+        data->hash_id = filedict->hash_id;
+        data->hash_seed = filedict->hash_seed;
+        created = 1;
+    }
+    else if (data->magic != FILEDICT_MAGIC) {
+        filedict->error = "Not a filedict file (or made by an older version of filedict)";
+        return;
+    }
+    else if (data->version != FILEDICT_VERSION) {
+        filedict->error = "Unsupported filedict version";
+        return;
+    }
+
+    if (data->hash_id >= FILEDICT_HASH_COUNT) {
+        filedict->error = "Unknown hash function in filedict header";
+        return;
+    }
+    filedict->hash_id = data->hash_id;
+    filedict->hash_seed = data->hash_seed;
+    filedict->hash_function = filedict_hash_functions[data->hash_id];
+    filedict->features = data->features;
+    if (created) {
+        filedict_apply_map_options(filedict, 0, filedict->data_len, filedict->data_len);
+        filedict_mark_dirty(filedict, data, sizeof(filedict_header_t));
+    }
+
+    /*
+     * The file may have grown between our fstat and now. No real generation is odd, so this makes
+     * sure the first refresh looks at the header.
+     */
+    filedict->generation = 1;
+    filedict_refresh(filedict);
+    if (filedict->error) return;
+
+    if (created && (filedict->features & FILEDICT_FEATURE_CHAIN_FILTER)) {
+        filter_offset = filedict_alloc(filedict, FILEDICT_BLOCK_FILTER, (size_t)initial_bucket_count * FILEDICT_CHAIN_FILTER_BITS / 8);
+        if (filter_offset == 0) return;
+
+        data = (filedict_header_t *)filedict->data;
+        data->chain_filter_bits = FILEDICT_CHAIN_FILTER_BITS;
+        __atomic_store_n(&data->chain_filter_offset, filter_offset, __ATOMIC_RELEASE);
+    }
+
+    if (created && (filedict->features & FILEDICT_FEATURE_CHANGE_LOG)) {
+        change_log_offset = filedict_alloc(filedict, FILEDICT_BLOCK_CHANGE_LOG, FILEDICT_CHANGE_LOG_RECORDS * sizeof(filedict_change_t));
+        if (change_log_offset == 0) return;
+
+        data = (filedict_header_t *)filedict->data;
+        data->change_log_records = FILEDICT_CHANGE_LOG_RECORDS;
+        __atomic_store_n(&data->change_log_offset, change_log_offset, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Entries normally hold the key followed by NUL-separated values, ending at the first empty one:
+ *
+ *     key\0value1\0value2\0\0...
+ *
+ * In files with FILEDICT_FEATURE_LENGTH_PREFIXED, the key is followed by a header: the index in
+ * the entry where the values end, and how many there are. Each value comes after its length + 1,
+ * and is padded to keep those lengths 2-byte aligned. A length of 0 marks the end.
+ *
+ *     key\0 [pad] end count (len+1) value1\0 [pad] (len+1) value2\0 [pad] 0...
+ *
+ * So getting to the next value or the end is a jump, and comparing values can start with lengths.
+ * All of the 2-byte numbers are aligned, so writers can publish them atomically.
+ */
+#define filedict_length_prefixed(filedict) ((filedict)->features & FILEDICT_FEATURE_LENGTH_PREFIXED)
+#define filedict_entry_header_i(key_len) (((key_len) + 2) & ~(size_t)1)
+#define filedict_entry_u16(entry, i) ((unsigned short *)&(entry)->bytes[i])
+
+/* The index in a new entry where its first value goes */
+#define filedict_values_start(filedict, key_len) \
+    (filedict_length_prefixed(filedict) ? filedict_entry_header_i(key_len) + 4 : (key_len) + 1)
+
+/* How many bytes of the entry a value stored_len bytes long takes up */
+#define filedict_value_bytes(filedict, stored_len) \
+    (filedict_length_prefixed(filedict) ? ((stored_len) + 4) & ~(size_t)1 : (stored_len) + 1)
+
+/* Where the value at slot_i starts, counting its length */
+#define filedict_value_start(filedict, slot_i) (filedict_length_prefixed(filedict) ? (slot_i) - 2 : (slot_i))
+
+/*
+ * Returns the index in entry->bytes of the value starting at index i (see filedict_value_start),
+ * or 0 when i is past the entry's last value.
+ */
+static size_t filedict_entry_slot(filedict_t *filedict, const filedict_bucket_entry_t *entry, size_t i) {
+    if (filedict_length_prefixed(filedict)) {
+        if (i + 2 > FILEDICT_BUCKET_ENTRY_BYTES) return 0;
+        return __atomic_load_n(filedict_entry_u16(entry, i), __ATOMIC_ACQUIRE) != 0 ? i + 2 : 0;
+    }
+    return i < FILEDICT_BUCKET_ENTRY_BYTES && __atomic_load_n(&entry->bytes[i], __ATOMIC_ACQUIRE) != 0 ? i : 0;
+}
+
+/* The index in entry->bytes of the entry's first value, or 0 if it doesn't have any */
+#define filedict_entry_first_value(filedict, entry, key_len) \
+    filedict_entry_slot((filedict), (entry), filedict_values_start((filedict), (key_len)))
+
+/*
+ * Returns the index in entry->bytes of the value after the one at slot_i, or 0 if that was the last.
+ */
+static size_t filedict_entry_next_value(filedict_t *filedict, const filedict_bucket_entry_t *entry, size_t slot_i) {
+    if (filedict_length_prefixed(filedict)) {
+        return filedict_entry_slot(filedict, entry, (slot_i + *filedict_entry_u16(entry, slot_i - 2) + 1) & ~(size_t)1);
+    }
+    return filedict_entry_slot(
+        filedict,
+        entry,
+        slot_i + strnlen(&entry->bytes[slot_i], FILEDICT_BUCKET_ENTRY_BYTES - slot_i) + 1
+    );
+}
+
+/*
+ * Returns the length of the value stored at slot_i. For heap values, that's the reference's length.
+ */
+static size_t filedict_entry_value_len(filedict_t *filedict, const filedict_bucket_entry_t *entry, size_t slot_i) {
+    if (filedict_length_prefixed(filedict)) return *filedict_entry_u16(entry, slot_i - 2) - 1;
+    return strnlen(&entry->bytes[slot_i], FILEDICT_BUCKET_ENTRY_BYTES - slot_i);
+}
+
+/*
+ * Returns the index in entry->bytes of the free space after the entry's last value.
+ * When unique_value isn't NULL and the entry already holds it (all unique_len bytes of it),
+ * returns 0 instead.
+ */
+static size_t filedict_entry_tail(
+    filedict_t *filedict,
+    filedict_bucket_entry_t *entry,
+    size_t key_len,
+    const char *unique_value,
+    size_t unique_len
+) {
+    size_t slot_i, last_i = 0;
+    const char *existing;
+
+    for (slot_i = filedict_entry_first_value(filedict, entry, key_len); slot_i != 0; slot_i = filedict_entry_next_value(filedict, entry, slot_i)) {
+        last_i = slot_i;
+        if (unique_value == NULL) {
+            /* Length-prefixed entries know where they end */
+            if (filedict_length_prefixed(filedict)) break;
+            continue;
+        }
+
+        if (filedict_is_heap_ref(&entry->bytes[slot_i])) {
+            existing = filedict_resolve_value(filedict, &entry->bytes[slot_i]);
+            if (existing && strncmp(existing, unique_value, unique_len) == 0 && existing[unique_len] == 0) return 0;
+        }
+        else if (filedict_entry_value_len(filedict, entry, slot_i) == unique_len) {
+            /* Looks like this value might already exist! */
+            if (memcmp(&entry->bytes[slot_i], unique_value, unique_len) == 0) return 0;
+        }
+    }
+
+    if (filedict_length_prefixed(filedict)) {
+        return *filedict_entry_u16(entry, filedict_entry_header_i(key_len));
+    }
+    if (last_i == 0) return key_len + 1;
+    return last_i + filedict_entry_value_len(filedict, entry, last_i) + 1;
+}
+
+/*
+ * Values that need a heap reference instead of being stored inline.
+ */
+#define filedict_value_in_heap(filedict, key_len, value, value_len) \
+    ((value_len) >= FILEDICT_HEAP_VALUE_BYTES || \
+     filedict_values_start(filedict, key_len) + filedict_value_bytes(filedict, value_len) > FILEDICT_BUCKET_ENTRY_BYTES || \
+     ((value_len) > 0 && filedict_is_heap_ref(value)))
+
+/*
+ * Adds the value written at index tail of the entry at entry_offset to the change log, if the file
+ * has one. key_hash is the entry's key's hash, which tells us what chain the entry is in.
+ */
+static void filedict_record_change(filedict_t *filedict, size_t key_hash, size_t entry_offset, size_t tail) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    size_t change_log_offset = __atomic_load_n(&header->change_log_offset, __ATOMIC_ACQUIRE), bucket_offset;
+    filedict_bucket_t *bucket = &filedict_buckets(filedict)[key_hash % header->initial_bucket_count];
+    filedict_change_t *change;
+    unsigned long long seq;
+
+    if (change_log_offset == 0) return;
+
+    while (1) {
+        bucket_offset = (char *)bucket - (char *)filedict->data;
+        if (entry_offset >= bucket_offset && entry_offset < bucket_offset + sizeof(filedict_bucket_t)) break;
+        if (bucket->next == 0) return;
+        bucket = filedict_bucket_at(filedict, bucket->next);
+        if (bucket == NULL) return;
+    }
+
+    seq = __atomic_add_fetch(&header->change_seq, 1, __ATOMIC_ACQ_REL);
+    change = (filedict_change_t *)((char *)filedict->data + change_log_offset) + (seq - 1) % header->change_log_records;
+
+    change->bucket_offset = bucket_offset;
+    change->entry_i = (entry_offset - (size_t)((char *)bucket->entries - (char *)filedict->data)) / sizeof(filedict_bucket_entry_t);
+    change->slot_i = filedict_length_prefixed(filedict) ? tail + 2 : tail;
+    __atomic_store_n(&change->seq, seq, __ATOMIC_RELEASE);
+
+    filedict_mark_dirty(filedict, change, sizeof(filedict_change_t));
+    filedict_mark_dirty(filedict, header, sizeof(filedict_header_t));
+}
+
+/*
+ * Writes value (or a reference to it in the heap) at index tail of the entry at entry_offset.
+ * Returns the entry's new tail, or 0 with filedict->error set if we couldn't allocate heap space.
+ *
+ * Whatever marks the end of the values goes in last: the first byte of the value, or its length in
+ * length-prefixed entries. Until then it's 0, which readers take as the end of the values, so they
+ * never see a value that's only partly written.
+ */
+static size_t filedict_write_value(
+    filedict_t *filedict,
+    size_t entry_offset,
+    size_t key_len,
+    size_t tail,
+    const char *value,
+    size_t value_len,
+    int in_heap
+) {
+    filedict_bucket_entry_t *entry;
+    char heap_ref[FILEDICT_HEAP_REF_BYTES + 1];
+    size_t heap_offset, header_i;
+
+    if (in_heap) {
+        heap_offset = filedict_alloc(filedict, FILEDICT_BLOCK_VALUE, value_len + 1);
+        if (heap_offset == 0) return 0;
+        memcpy((char *)filedict->data + heap_offset, value, value_len);
+        ((char *)filedict->data)[heap_offset + value_len] = 0;
+        filedict_mark_dirty(filedict, (char *)filedict->data + heap_offset, value_len + 1);
+        __atomic_fetch_add(&((filedict_header_t *)filedict->data)->heap_bytes, value_len + 1, __ATOMIC_RELAXED);
+
+        filedict_encode_heap_ref(heap_ref, heap_offset);
+        heap_ref[FILEDICT_HEAP_REF_BYTES] = 0;
+        value = heap_ref;
+        value_len = FILEDICT_HEAP_REF_BYTES;
+    }
+
+    entry = (filedict_bucket_entry_t *)((char *)filedict->data + entry_offset);
+    filedict_mark_dirty(filedict, entry, FILEDICT_BUCKET_ENTRY_BYTES);
+
+    if (filedict_length_prefixed(filedict)) {
+        header_i = filedict_entry_header_i(key_len);
+
+        memcpy(&entry->bytes[tail + 2], value, value_len);
+        entry->bytes[tail + 2 + value_len] = 0;
+        __atomic_store_n(filedict_entry_u16(entry, tail), (unsigned short)(value_len + 1), __ATOMIC_RELEASE);
+
+        tail += filedict_value_bytes(filedict, value_len);
+        *filedict_entry_u16(entry, header_i + 2) += 1;
+        __atomic_store_n(filedict_entry_u16(entry, header_i), (unsigned short)tail, __ATOMIC_RELEASE);
+        return tail;
+    }
+
+    if (value_len > 0) {
+        memcpy(&entry->bytes[tail + 1], value + 1, value_len - 1);
+        entry->bytes[tail + value_len] = 0;
+        __atomic_store_n(&entry->bytes[tail], value[0], __ATOMIC_RELEASE);
+    }
+    return tail + value_len + 1;
+}
+
+/*
+ * This is filedict_insert_f after the key has been hashed and measured.
+ *
+ * When entry_out isn't NULL, it's set to the file offset of the entry that got the value, and
+ * tail_out to the index in that entry right after the value. Both are 0 when nothing was written.
+ */
+static void filedict_insert_hashed(
+    filedict_t *filedict,
+    const char *key,
+    size_t key_len,
+    size_t key_hash,
+    const char *value,
+    size_t value_len,
+    int unique,
+    size_t *entry_out,
+    size_t *tail_out
+) {
+    size_t bytes_i = 0, value_tail, stored_len, new_bucket_offset = 0, chain_length = 1;
+    /* File offsets of the entry that gets the value, of the tag to set when it's a fresh entry, and
+     * of the bucket to link a new overflow bucket to. We use offsets because allocating remaps. */
+    size_t entry_offset = 0, tag_offset = 0, link_offset = 0;
+    /* The first removed entry in the chain, which we can reuse if the key isn't in the chain yet */
+    size_t removed_entry_offset = 0, removed_tag_offset = 0;
+    /* In unique mode, the first entry of the key with room, and where its values end */
+    size_t room_entry_offset = 0, room_tail = 0;
+    int key_found = 0;
+    unsigned long long hits, empties, removed;
+    unsigned char key_tag = filedict_hash_tag(key_hash);
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_bucket_t *bucket;
+    filedict_bucket_entry_t *entry;
+    int in_heap = filedict_value_in_heap(filedict, key_len, value, value_len);
+
+    if (entry_out) *entry_out = 0;
+    if (tail_out) *tail_out = 0;
+
+    stored_len = in_heap ? FILEDICT_HEAP_REF_BYTES : value_len;
+
+    if (filedict_values_start(filedict, key_len) + filedict_value_bytes(filedict, stored_len) > FILEDICT_BUCKET_ENTRY_BYTES) {
+        filedict->error = "Key too big";
+        return;
+    }
+
+    /* TODO: can we truncate instead of modulo, like in Ruby? */
+    bucket = &filedict_buckets(filedict)[key_hash % header->initial_bucket_count];
+
+    /*
+     * Here we loop through the bucket and its overflow chain.
+     */
+    while (1) {
+        /*
+         * We need to check for room in the value, then append value.
+         * This is also where we might run into a duplicate and duck out.
+         *
+         * Only entries whose tag matches can possibly hold our key.
+         */
+        for (hits = filedict_bucket_match(bucket, key_tag); hits != 0; hits &= hits - 1) {
+            entry = &bucket->entries[__builtin_ctzll(hits)];
+
+            if (memcmp(entry->bytes, key, key_len) == 0 && entry->bytes[key_len] == 0) {
+                key_found = 1;
+                bytes_i = filedict_entry_tail(filedict, entry, key_len, unique ? value : NULL, value_len);
+                if (bytes_i == 0) return;
+
+                if (bytes_i + filedict_value_bytes(filedict, stored_len) <= FILEDICT_BUCKET_ENTRY_BYTES) {
+                    entry_offset = entry->bytes - (char *)filedict->data;
+                    if (!unique) goto write_value;
+
+                    /* The value could still be in one of the key's later entries */
+                    if (room_entry_offset == 0) {
+                        room_entry_offset = entry_offset;
+                        room_tail = bytes_i;
+                    }
+                }
+            }
+        }
+
+        /*
+         * Easy case: fresh entry. We can just insert here and call it quits.
+         *
+         * Entries are always claimed in order, so any entry holding our key comes before the first
+         * free one. That's why it's safe to check the matches above before looking for a free entry.
+         */
+        removed = removed_tag_offset == 0 ? filedict_bucket_match(bucket, FILEDICT_TAG_REMOVED) : 0;
+        if (removed != 0) {
+            removed_tag_offset = &bucket->tags[__builtin_ctzll(removed)] - (unsigned char *)filedict->data;
+            removed_entry_offset = bucket->entries[__builtin_ctzll(removed)].bytes - (char *)filedict->data;
+        }
+
+        empties = filedict_bucket_match(bucket, FILEDICT_TAG_EMPTY);
+        if (empties != 0) {
+            if (room_entry_offset != 0) goto append_to_room;
+            if (!key_found && removed_tag_offset != 0) goto reuse_removed;
+
+            entry = &bucket->entries[__builtin_ctzll(empties)];
+            tag_offset = &bucket->tags[__builtin_ctzll(empties)] - (unsigned char *)filedict->data;
+            entry_offset = entry->bytes - (char *)filedict->data;
+            goto write_value;
+        }
+
+        if (bucket->next == 0) break;
+        bucket = filedict_bucket_at(filedict, bucket->next);
+        if (bucket == NULL) return;
+        chain_length += 1;
+    }
+
+    if (room_entry_offset != 0) {
+append_to_room:
+        entry_offset = room_entry_offset;
+        bytes_i = room_tail;
+        goto write_value;
+    }
+
+    /*
+     * A removed entry can take the key, unless the key already has entries further down the chain.
+     * Then its new values have to come after those, so they stay in the order they were inserted.
+     */
+    if (!key_found && removed_tag_offset != 0) {
+reuse_removed:
+        tag_offset = removed_tag_offset;
+        entry_offset = removed_entry_offset;
+        memset((char *)filedict->data + entry_offset, 0, FILEDICT_BUCKET_ENTRY_BYTES);
+        goto write_value;
+    }
+
+    /*
+     * If we fell through to here, that means the whole chain is full and we need a new bucket.
+     * We fill it in before linking it, so readers never see it half-written.
+     */
+    link_offset = (char *)bucket - (char *)filedict->data;
+    new_bucket_offset = filedict_alloc(filedict, FILEDICT_BLOCK_BUCKET, sizeof(filedict_bucket_t));
+    if (new_bucket_offset == 0) return;
+    filedict_stat_add(filedict, overflow_buckets_added, 1);
+    chain_length += 1;
+    bucket = (filedict_bucket_t *)((char *)filedict->data + new_bucket_offset);
+    tag_offset = bucket->tags - (unsigned char *)filedict->data;
+    entry_offset = bucket->entries[0].bytes - (char *)filedict->data;
+
+write_value:
+    filedict_stat_add(filedict, inserts, 1);
+    filedict_stat_histogram(filedict, insert_chain_lengths, chain_length);
+
+    if (tag_offset != 0) {
+        /* We're claiming a fresh entry, which starts with the key */
+        entry = (filedict_bucket_entry_t *)((char *)filedict->data + entry_offset);
+        memcpy(entry->bytes, key, key_len);
+        entry->bytes[key_len] = 0;
+        bytes_i = filedict_values_start(filedict, key_len);
+        if (filedict_length_prefixed(filedict)) *filedict_entry_u16(entry, filedict_entry_header_i(key_len)) = bytes_i;
+    }
+
+    /* This might allocate heap space, so "entry" and "bucket" are no good after this */
+    value_tail = bytes_i;
+    bytes_i = filedict_write_value(filedict, entry_offset, key_len, bytes_i, value, value_len, in_heap);
+    if (bytes_i == 0) return;
+
+    /* Past the initial bucket, so readers need to know to look further. (Or the key was already there.) */
+    if (chain_length > 1) filedict_chain_filter_add(filedict, key_hash);
+
+    if (tag_offset != 0 && !key_found) {
+        filedict_key_index_add(filedict, key, key_len);
+        if (filedict->error) return;
+    }
+
+    /* Now that everything is written, we can let readers see it */
+    if (tag_offset != 0) {
+        __atomic_store_n((unsigned char *)filedict->data + tag_offset, key_tag, __ATOMIC_RELEASE);
+        filedict_mark_dirty(filedict, (char *)filedict->data + tag_offset, 1);
+    }
+    if (link_offset != 0) {
+        header = (filedict_header_t *)filedict->data;
+        __atomic_fetch_add(&header->overflow_bucket_count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(
+            &((filedict_bucket_t *)((char *)filedict->data + link_offset))->next,
+            new_bucket_offset,
+            __ATOMIC_RELEASE
+        );
+        filedict_mark_dirty(filedict, header, sizeof(filedict_header_t));
+        filedict_mark_dirty(filedict, (char *)filedict->data + link_offset, sizeof(unsigned long long));
+    }
+    filedict_record_change(filedict, key_hash, entry_offset, value_tail);
+
+    if (entry_out) *entry_out = entry_offset;
+    if (tail_out) *tail_out = bytes_i;
+}
+
+/*
+ * Inserts a new value under "key". Filedict keys have multiple values, so this will "append" a new
+ * value onto the end of the entry.
+ */
+#define filedict_insert(filedict, key, value) filedict_insert_f(filedict, key, value, 0)
+#define filedict_insert_unique(filedict, key, value) filedict_insert_f(filedict, key, value, 1)
+
+/*
+ * Same as filedict_insert and filedict_insert_unique, for keys and values that come with their
+ * length and don't need to end in a NUL byte. They can't contain NUL bytes, though: those set
+ * filedict->error without writing anything.
+ */
+#define filedict_insert_n(filedict, key, key_len, value, value_len) \
+    filedict_insert_nf(filedict, key, key_len, value, value_len, 0)
+#define filedict_insert_unique_n(filedict, key, key_len, value, value_len) \
+    filedict_insert_nf(filedict, key, key_len, value, value_len, 1)
+
+static void filedict_insert_nf(
+    filedict_t *filedict,
+    const char *key,
+    size_t key_len,
+    const char *value,
+    size_t value_len,
+    int unique
+) {
+    assert(filedict->fd != 0);
+    assert(filedict->data != NULL);
+
+    size_t key_hash, bucket_i;
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+
+    /* The key would be cut short, or the value split in two */
+    if (memchr(key, 0, key_len) != NULL || memchr(value, 0, value_len) != NULL) {
+        filedict->error = "Keys and values can't contain NUL bytes";
+        return;
+    }
+
+    if (filedict_refresh(filedict)) header = (filedict_header_t *)filedict->data;
+    if (filedict->error) return;
+
+    key_hash = filedict->hash_function(key, key_len, filedict->hash_seed);
+    bucket_i = key_hash % header->initial_bucket_count;
+
+    filedict_lock_bucket(filedict, bucket_i);
+    filedict_insert_hashed(filedict, key, key_len, key_hash, value, value_len, unique, NULL, NULL);
+    filedict_unlock_bucket(filedict, bucket_i);
+    filedict_after_write(filedict);
+}
+
+static void filedict_insert_f(filedict_t *filedict, const char *key, const char *value, int unique) {
+    filedict_insert_nf(filedict, key, strlen(key), value, strlen(value), unique);
+}
+/*
+ * Orders batch items by bucket, then by key hash so equal keys end up next to each other, then by
+ * their original position so each key's values keep their order.
+ */
+static int filedict_batch_item_less(
+    const filedict_batch_item_t *a,
+    const filedict_batch_item_t *b,
+    size_t bucket_count
+) {
+    size_t a_bucket = a->key_hash % bucket_count;
+    size_t b_bucket = b->key_hash % bucket_count;
+
+    if (a_bucket != b_bucket) return a_bucket < b_bucket;
+    if (a->key_hash != b->key_hash) return a->key_hash < b->key_hash;
+    return a->order < b->order;
+}
+
+static void filedict_batch_sift_down(
+    filedict_batch_item_t *items,
+    size_t root,
+    size_t count,
+    size_t bucket_count
+) {
+    filedict_batch_item_t swap;
+    size_t child;
+
+    while ((child = root * 2 + 1) < count) {
+        if (child + 1 < count && filedict_batch_item_less(&items[child], &items[child + 1], bucket_count)) {
+            child += 1;
+        }
+        if (!filedict_batch_item_less(&items[root], &items[child], bucket_count)) return;
+
+        swap = items[root];
+        items[root] = items[child];
+        items[child] = swap;
+        root = child;
+    }
+}
+
+/*
+ * Heapsort, since we don't allocate memory (so no qsort).
+ */
+static void filedict_batch_sort(filedict_batch_item_t *items, size_t count, size_t bucket_count) {
+    filedict_batch_item_t swap;
+    size_t i;
+
+    if (count < 2) return;
+
+    for (i = count / 2; i > 0; --i) {
+        filedict_batch_sift_down(items, i - 1, count, bucket_count);
+    }
+    for (i = count - 1; i > 0; --i) {
+        swap = items[0];
+        items[0] = items[i];
+        items[i] = swap;
+        filedict_batch_sift_down(items, 0, i, bucket_count);
+    }
+}
+
+#define filedict_batch_same_key(a, b) \
+    ((a)->key_hash == (b)->key_hash && (a)->key_len == (b)->key_len && strcmp((a)->key, (b)->key) == 0)
+
+/*
+ * Inserts many key/value pairs at once. This is the same as calling filedict_insert_f on each item,
+ * except each key's values might end up in a different order relative to values that were already
+ * in the file.
+ *
+ * It hashes everything up front, sorts the items by bucket (this reorders your array!), grows the
+ * file once for everything the batch could possibly need, and then fills each bucket in one go.
+ * Runs of values under the same key are appended without looking for the end of the entry again.
+ * Empty values are skipped, unless the file has FILEDICT_FEATURE_LENGTH_PREFIXED.
+ *
+ * Nothing is written if any key is too big.
+ */
+#define filedict_insert_batch(filedict, items, count) filedict_insert_batch_f(filedict, items, count, 0)
+#define filedict_insert_batch_unique(filedict, items, count) filedict_insert_batch_f(filedict, items, count, 1)
+
+static void filedict_insert_batch_f(
+    filedict_t *filedict,
+    filedict_batch_item_t *items,
+    size_t count,
+    int unique
+) {
+    assert(filedict->fd != 0);
+    assert(filedict->data != NULL);
+
+    size_t i, j, bucket_count, stored_len, group_entries, run_bytes;
+    size_t reserve = 0, entry_offset = 0, tail = 0, value_tail;
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_batch_item_t *item;
+    int in_heap;
+
+    if (filedict_refresh(filedict)) header = (filedict_header_t *)filedict->data;
+    if (filedict->error) return;
+    bucket_count = header->initial_bucket_count;
+
+    /*
+     * Hash everything first, and make sure it all fits before we write anything.
+     */
+    for (i = 0; i < count; ++i) {
+        item = &items[i];
+        item->key_len = strlen(item->key);
+        item->value_len = strlen(item->value);
+        item->key_hash = filedict->hash_function(item->key, item->key_len, filedict->hash_seed);
+        item->order = i;
+
+        in_heap = filedict_value_in_heap(filedict, item->key_len, item->value, item->value_len);
+        stored_len = in_heap ? FILEDICT_HEAP_REF_BYTES : item->value_len;
+
+        if (filedict_values_start(filedict, item->key_len) + filedict_value_bytes(filedict, stored_len) > FILEDICT_BUCKET_ENTRY_BYTES) {
+            filedict->error = "Key too big";
+            return;
+        }
+        if (in_heap) {
+            reserve += sizeof(filedict_block_t) + ((item->value_len + 1 + 7) & ~(size_t)7);
+        }
+    }
+
+    filedict_batch_sort(items, count, bucket_count);
+
+    /*
+     * Work out how many overflow buckets we could need at most. Each run of values under one key
+     * fills at most as many entries as its bytes take up (plus one for the remainder), and each
+     * group of items that land in the same bucket can't need more buckets than those entries fill.
+     */
+    for (i = 0; i < count; i = j) {
+        group_entries = 0;
+        run_bytes = 0;
+
+        for (j = i; j < count && items[j].key_hash % bucket_count == items[i].key_hash % bucket_count; ++j) {
+            item = &items[j];
+            in_heap = filedict_value_in_heap(filedict, item->key_len, item->value, item->value_len);
+            run_bytes += filedict_value_bytes(filedict, in_heap ? FILEDICT_HEAP_REF_BYTES : item->value_len);
+
+            if (j + 1 == count || !filedict_batch_same_key(item, &items[j + 1])) {
+                group_entries += run_bytes / (FILEDICT_BUCKET_ENTRY_BYTES - filedict_values_start(filedict, item->key_len)) + 1;
+                run_bytes = 0;
+            }
+        }
+
+        reserve += (group_entries + FILEDICT_BUCKET_ENTRY_COUNT - 1) / FILEDICT_BUCKET_ENTRY_COUNT *
+            (sizeof(filedict_block_t) + sizeof(filedict_bucket_t));
+    }
+
+    filedict_reserve(filedict, reserve);
+    if (filedict->error) return;
+
+    /*
+     * Now write everything, bucket by bucket.
+     */
+    for (i = 0; i < count; ++i) {
+        item = &items[i];
+
+        if (i == 0 || item->key_hash % bucket_count != items[i - 1].key_hash % bucket_count) {
+            if (i > 0) filedict_unlock_bucket(filedict, items[i - 1].key_hash % bucket_count);
+            filedict_lock_bucket(filedict, item->key_hash % bucket_count);
+        }
+
+        /*
+         * Without lengths, an empty value would be a bare 0 that ends the entry's values, hiding
+         * everything written after it. The next item may not share the entry's key, so forget it.
+         */
+        if (item->value_len == 0 && !filedict_length_prefixed(filedict)) {
+            entry_offset = 0;
+            continue;
+        }
+
+        if (!unique && entry_offset != 0 && i > 0 && filedict_batch_same_key(item, &items[i - 1])) {
+            /* Keep appending to the entry we just wrote to, if there's room */
+            in_heap = filedict_value_in_heap(filedict, item->key_len, item->value, item->value_len);
+            stored_len = in_heap ? FILEDICT_HEAP_REF_BYTES : item->value_len;
+
+            if (tail + filedict_value_bytes(filedict, stored_len) <= FILEDICT_BUCKET_ENTRY_BYTES) {
+                value_tail = tail;
+                tail = filedict_write_value(filedict, entry_offset, item->key_len, tail, item->value, item->value_len, in_heap);
+                if (tail == 0) break;
+                filedict_record_change(filedict, item->key_hash, entry_offset, value_tail);
+                continue;
+            }
+        }
+
+        filedict_insert_hashed(
+            filedict,
+            item->key,
+            item->key_len,
+            item->key_hash,
+            item->value,
+            item->value_len,
+            unique,
+            &entry_offset,
+            &tail
+        );
+        if (filedict->error) break;
+    }
+
+    if (count > 0) {
+        filedict_unlock_bucket(filedict, items[i < count ? i : count - 1].key_hash % bucket_count);
+    }
+    filedict_after_write(filedict);
+}
+
+/*
+ * Removed values are cut out of their entry, and the values after them move down to close the gap.
+ * An entry that runs out of values gets FILEDICT_TAG_REMOVED, which lets a later insert of a new key
+ * take it. Heap values of removed values stay in the file until it's compacted.
+ *
+ * Readers don't lock, so a reader that's going through the values of a key while one of them is
+ * being removed can skip a value, or see one twice.
+ */
+static void filedict_remove_entry(filedict_bucket_t *bucket, size_t entry_i) {
+    __atomic_store_n(&bucket->tags[entry_i], FILEDICT_TAG_REMOVED, __ATOMIC_RELEASE);
+}
+
+/*
+ * Cuts the value at entry->bytes[slot_i] out of the entry. Returns 1 when that was its last value.
+ */
+static int filedict_entry_cut(filedict_t *filedict, filedict_bucket_entry_t *entry, size_t key_len, size_t slot_i) {
+    size_t tail = filedict_entry_tail(filedict, entry, key_len, NULL, 0);
+    size_t start = filedict_value_start(filedict, slot_i);
+    size_t slot_len = filedict_value_bytes(filedict, filedict_entry_value_len(filedict, entry, slot_i));
+    size_t header_i = filedict_entry_header_i(key_len);
+
+    memmove(&entry->bytes[start], &entry->bytes[start + slot_len], tail - start - slot_len);
+    memset(&entry->bytes[tail - slot_len], 0, slot_len);
+
+    if (filedict_length_prefixed(filedict)) {
+        *filedict_entry_u16(entry, header_i) = tail - slot_len;
+        *filedict_entry_u16(entry, header_i + 2) -= 1;
+    }
+    return tail - slot_len == filedict_values_start(filedict, key_len);
+}
+
+static size_t filedict_entry_value_count(filedict_t *filedict, filedict_bucket_entry_t *entry) {
+    size_t key_len = strnlen(entry->bytes, FILEDICT_BUCKET_ENTRY_BYTES), slot_i, count = 0;
+
+    if (filedict_length_prefixed(filedict)) {
+        return *filedict_entry_u16(entry, filedict_entry_header_i(key_len) + 2);
+    }
+    for (slot_i = filedict_entry_first_value(filedict, entry, key_len); slot_i != 0; slot_i = filedict_entry_next_value(filedict, entry, slot_i)) {
+        count += 1;
+    }
+    return count;
+}
+
+/*
+ * Removes value from key's entries, or the whole key when value is NULL.
+ * Returns how many values were removed.
+ */
+static size_t filedict_remove_hashed(
+    filedict_t *filedict,
+    const char *key,
+    size_t key_len,
+    size_t key_hash,
+    const char *value
+) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_bucket_t *bucket = &filedict_buckets(filedict)[key_hash % header->initial_bucket_count];
+    filedict_bucket_entry_t *entry;
+    unsigned char key_tag = filedict_hash_tag(key_hash);
+    unsigned long long hits;
+    size_t removed = 0, entry_i, slot_i;
+    const char *existing;
+
+    while (1) {
+        for (hits = filedict_bucket_match(bucket, key_tag); hits != 0; hits &= hits - 1) {
+            entry_i = __builtin_ctzll(hits);
+            entry = &bucket->entries[entry_i];
+            if (strncmp(entry->bytes, key, FILEDICT_BUCKET_ENTRY_BYTES) != 0) continue;
+
+            if (value == NULL) {
+                removed += filedict_entry_value_count(filedict, entry);
+                filedict_remove_entry(bucket, entry_i);
+                filedict_mark_dirty(filedict, &bucket->tags[entry_i], 1);
+                continue;
+            }
+
+            slot_i = filedict_entry_first_value(filedict, entry, key_len);
+            while (slot_i != 0) {
+                existing = filedict_resolve_value(filedict, &entry->bytes[slot_i]);
+
+                if (existing == NULL || strcmp(existing, value) != 0) {
+                    slot_i = filedict_entry_next_value(filedict, entry, slot_i);
+                    continue;
+                }
+
+                /* The next value moves into slot_i, so we look at slot_i again */
+                removed += 1;
+                filedict_mark_dirty(filedict, entry, FILEDICT_BUCKET_ENTRY_BYTES);
+                if (filedict_entry_cut(filedict, entry, key_len, slot_i)) {
+                    filedict_remove_entry(bucket, entry_i);
+                    filedict_mark_dirty(filedict, &bucket->tags[entry_i], 1);
+                    break;
+                }
+                slot_i = filedict_entry_slot(filedict, entry, filedict_value_start(filedict, slot_i));
+            }
+        }
+
+        if (bucket->next == 0) break;
+        if (bucket == filedict_buckets(filedict) + key_hash % header->initial_bucket_count &&
+            !filedict_chain_filter_has(filedict, key_hash)) break;
+        bucket = filedict_bucket_at(filedict, bucket->next);
+        if (bucket == NULL) break;
+    }
+
+    return removed;
+}
+
+/*
+ * Removes key and all of its values, or just the given value of key.
+ * Both return how many values were removed.
+ */
+#define filedict_remove(filedict, key) filedict_remove_f(filedict, key, NULL)
+#define filedict_remove_value(filedict, key, value) filedict_remove_f(filedict, key, value)
+
+static size_t filedict_remove_f(filedict_t *filedict, const char *key, const char *value) {
+    assert(filedict->fd != 0);
+    assert(filedict->data != NULL);
+
+    size_t key_len = strlen(key), key_hash, bucket_i, removed;
+
+    filedict_refresh(filedict);
+    if (filedict->error) return 0;
+
+    key_hash = filedict->hash_function(key, key_len, filedict->hash_seed);
+    bucket_i = key_hash % ((filedict_header_t *)filedict->data)->initial_bucket_count;
+
+    filedict_lock_bucket(filedict, bucket_i);
+    /* Make sure every heap value in the chain is mapped, so we can compare against them */
+    filedict_resize(filedict);
+    removed = filedict->error ? 0 : filedict_remove_hashed(filedict, key, key_len, key_hash, value);
+    filedict_unlock_bucket(filedict, bucket_i);
+    filedict_after_write(filedict);
+
+    return removed;
+}
+
+/*
+ * Removes every key that predicate returns nonzero for, along with all of its values.
+ * Returns how many values were removed.
+ */
+static size_t filedict_remove_if(filedict_t *filedict, filedict_remove_predicate_t predicate, void *context) {
+    assert(filedict->fd != 0);
+    assert(filedict->data != NULL);
+
     filedict_bucket_t *bucket;
+    unsigned long long live;
+    size_t bucket_i, bucket_count, entry_i, removed = 0;
+
+    filedict_refresh(filedict);
+    if (filedict->error) return 0;
+    bucket_count = ((filedict_header_t *)filedict->data)->initial_bucket_count;
+
+    for (bucket_i = 0; bucket_i < bucket_count && filedict->error == NULL; ++bucket_i) {
+        filedict_lock_bucket(filedict, bucket_i);
+
+        for (bucket = &filedict_buckets(filedict)[bucket_i]; bucket != NULL;) {
+            for (live = filedict_bucket_live(bucket); live != 0; live &= live - 1) {
+                entry_i = __builtin_ctzll(live);
+
+                if (predicate(bucket->entries[entry_i].bytes, context)) {
+                    removed += filedict_entry_value_count(filedict, &bucket->entries[entry_i]);
+                    filedict_remove_entry(bucket, entry_i);
+                    filedict_mark_dirty(filedict, &bucket->tags[entry_i], 1);
+                }
+            }
+            bucket = bucket->next ? filedict_bucket_at(filedict, bucket->next) : NULL;
+        }
+
+        filedict_unlock_bucket(filedict, bucket_i);
+    }
+
+    filedict_after_write(filedict);
+    return removed;
+}
+
+/*
+ * For filedict_remove_if: removes the keys that start with the string passed as context.
+ */
+static int filedict_key_has_prefix(const char *key, void *prefix) {
+    return strncmp(key, (const char *)prefix, strlen((const char *)prefix)) == 0;
+}
+
+/*
+ * There are 3 "levels" to a filedict. From top to bottom:
+ * 1. Bucket  - which bucket of the chain are we looking at? Full buckets link to overflow buckets.
+ * 2. Entry   - which entry in our bucket are we looking at?
+ * 3. Value   - where in the value buffer are we looking? There's 256 bytes, so can be many strings.
+ *              Big values live in the heap, and the value buffer only holds a reference to them.
+ */
+
+/* #define log_return(val) do { printf("%s -> %i\n", __func__, (val)); return (val); } while(0) */
+#define log_return(val) return val
+
+/*
+ * The length of a value resolved from slot. Inline values of length-prefixed entries have it
+ * stored right before them; the rest have to be measured.
+ */
+#define filedict_resolved_value_len(filedict, value, slot) \
+    ((value) == (slot) && filedict_length_prefixed(filedict) \
+        ? (size_t)*(unsigned short *)((slot) - 2) - 1 \
+        : strlen(value))
+
+#define filedict_read_value_len(read) filedict_resolved_value_len((read)->filedict, (read)->value, (read)->value_slot)
+
+/*
+ * Points read->value at the value stored in read->value_slot, following heap references.
+ *
+ * Returns 1 on success.
+ * Returns 0 with filedict->error set when the value isn't in the file.
+ */
+static int filedict_read_load_value(filedict_read_t *read) {
+    filedict_t *filedict = read->filedict;
+    size_t bucket_offset, entry_offset, slot_offset;
+
+    read->value = filedict_resolve_value(filedict, read->value_slot);
+    if (read->value != NULL) {
+        read->value_len = filedict_read_value_len(read);
+        log_return(1);
+    }
+
+    /* The value was added to the heap after we mapped the file */
+    bucket_offset = (char *)read->bucket - (char *)filedict->data;
+    entry_offset = (char *)read->entry - (char *)filedict->data;
+    slot_offset = read->value_slot - (char *)filedict->data;
+
+    filedict_resize(filedict);
+    if (filedict->error) log_return(0);
+
+    read->bucket = (filedict_bucket_t *)((char *)filedict->data + bucket_offset);
+    read->entry = (filedict_bucket_entry_t *)((char *)filedict->data + entry_offset);
+    read->value_slot = (char *)filedict->data + slot_offset;
+
+    read->value = filedict_resolve_value(filedict, read->value_slot);
+    if (read->value == NULL) {
+        filedict->error = "Heap value is past the end of the file";
+        log_return(0);
+    }
+    read->value_len = filedict_read_value_len(read);
+    log_return(1);
+}
+
+/*
+ * Returns 1 when we successfully advanced to the next value
+ * Returns 0 when there is no next value
+ */
+static int filedict_read_advance_value(filedict_read_t *read) {
+    assert(read->entry != NULL);
+
+    size_t slot_i = read->value_slot - read->entry->bytes, next_i;
+
+    /* We already know how long inline values are */
+    if (read->value == read->value_slot && !filedict_length_prefixed(read->filedict)) {
+        next_i = filedict_entry_slot(read->filedict, read->entry, slot_i + read->value_len + 1);
+    }
+    else {
+        next_i = filedict_entry_next_value(read->filedict, read->entry, slot_i);
+    }
+
+    filedict_stat_add(
+        read->filedict,
+        value_bytes_scanned,
+        filedict_length_prefixed(read->filedict) ? 2 : (next_i ? next_i : FILEDICT_BUCKET_ENTRY_BYTES) - slot_i
+    );
+    if (next_i == 0) log_return(0);
+
+    read->value_slot = &read->entry->bytes[next_i];
+    log_return(filedict_read_load_value(read));
+}
+
+/*
+ * Returns 1 when we successfully find a new entry that matches read->key.
+ *           advances read->entry_i and read->entry to the new entry.
+ *
+ * Returns 0 when we exhausted all remaining entries and didn't find a match.
+ */
+static int filedict_read_advance_entry(filedict_read_t *read) {
+    size_t value_start_i;
+    unsigned long long hits;
+
+    assert(read->bucket != NULL);
+
+    if (read->entry_i >= FILEDICT_BUCKET_ENTRY_COUNT) log_return(0);
+
+    if (read->key == NULL) {
+        hits = filedict_bucket_live(read->bucket);
+    }
+    else {
+        hits = filedict_bucket_match(read->bucket, read->key_tag);
+    }
+    /* Skip over the entries we've already visited */
+    hits &= ~0ULL << read->entry_i;
+    /* Pairs with the release store of the tag, so the entry bytes are all there once we see it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    for (; hits != 0; hits &= hits - 1) {
+        read->entry_i = __builtin_ctzll(hits);
+        read->entry = &read->bucket->entries[read->entry_i];
+
+        if (read->key == NULL) {
+            value_start_i = filedict_entry_first_value(read->filedict, read->entry, strlen(read->entry->bytes));
+            if (value_start_i == 0) continue;
+            read->value_slot = &read->entry->bytes[value_start_i];
+            log_return(filedict_read_load_value(read));
+        }
+        else {
+            filedict_stat_add(read->filedict, tag_matches, 1);
+
+            if (
+                read->key_len < FILEDICT_BUCKET_ENTRY_BYTES &&
+                memcmp(read->entry->bytes, read->key, read->key_len) == 0 &&
+                read->entry->bytes[read->key_len] == 0
+            ) {
+                value_start_i = filedict_entry_first_value(read->filedict, read->entry, read->key_len);
+                if (value_start_i == 0) continue;
+                read->value_slot = &read->entry->bytes[value_start_i];
+                log_return(filedict_read_load_value(read));
+            }
+            filedict_stat_add(read->filedict, tag_false_positives, 1);
+        }
+    }
+
+    read->entry_i = FILEDICT_BUCKET_ENTRY_COUNT;
+    log_return(0);
+}
+
+/*
+ * Returns 1 when we successfully found a matching entry in read->bucket or one of the buckets after it.
+ *           read->bucket, read->entry, and read->value will be populated.
+ *
+ * When read->key is NULL, this moves on to the next bucket of the hashmap once the current
+ * bucket's chain runs out, so we visit every entry of the whole dict.
+ *
+ * Returns 0 when there are no more buckets with matching entries.
+ */
+static int filedict_read_advance_bucket(filedict_read_t *read) {
+    filedict_t *filedict = read->filedict;
+    unsigned long long next;
+
+    assert(filedict);
+    assert(filedict->data);
+
+    while (1) {
+        if (filedict_read_advance_entry(read)) log_return(1);
+
+        next = __atomic_load_n(&read->bucket->next, __ATOMIC_ACQUIRE);
+
+        if (next != 0 && read->key != NULL && read->chain_i == 0 && !filedict_chain_filter_has(filedict, read->key_hash)) {
+            filedict_stat_add(filedict, chain_filter_skips, 1);
+            log_return(0);
+        }
+        else if (next != 0) {
+            read->bucket = filedict_bucket_at(filedict, next);
+            if (read->bucket == NULL) log_return(0);
+            read->chain_i += 1;
+        }
+        else if (read->key == NULL && read->key_hash + 1 < read->bucket_count) {
+            read->key_hash += 1;
+            read->bucket = &filedict_buckets(filedict)[read->key_hash];
+            read->chain_i = 0;
+        }
+        else {
+            log_return(0);
+        }
+
+        read->entry_i = 0;
+    }
+}
+
+/*
+ * Same as filedict_get, for a key that comes with its length and doesn't need to end in a NUL
+ * byte. The key has to stay around while you use the read. No key in the file contains a NUL byte,
+ * so keys that do always miss.
+ */
+static filedict_read_t filedict_get_n(filedict_t *filedict, const char *key, size_t key_len) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_read_t read;
+
+    if (filedict_refresh(filedict)) header = (filedict_header_t *)filedict->data;
+
+    read.filedict = filedict;
+    read.key = key;
+    read.key_len = key_len;
+    read.value = NULL;
+    read.value_len = 0;
+    read.value_slot = NULL;
+    read.entry = NULL;
+    read.entry_i = 0;
+    read.chain_i = 0;
+    read.bucket_count = header->initial_bucket_count;
+
+    /* NULL key means we want to iterate the whole entire dictionary */
+    if (key == NULL) {
+        read.key_hash = 0;
+        read.key_tag = FILEDICT_TAG_EMPTY;
+    }
+    else {
+        read.key_hash = filedict->hash_function(key, key_len, filedict->hash_seed);
+        read.key_tag = filedict_hash_tag(read.key_hash);
+    }
+
+    read.bucket = &filedict_buckets(filedict)[read.key_hash % read.bucket_count];
+
+    /* Otherwise the rest of the key could match an entry's first value */
+    if (key != NULL && memchr(key, 0, key_len) != NULL) read.value = NULL;
+    else if (!filedict_read_advance_bucket(&read)) read.value = NULL;
+
+    if (key != NULL) {
+        filedict_stat_add(filedict, gets, 1);
+        filedict_stat_add(filedict, get_misses, read.value == NULL);
+        filedict_stat_histogram(filedict, get_chain_lengths, read.chain_i + 1);
+    }
+    return read;
+}
+
+/*
+ * Returns a "read" at the given key. If there's a hit, <return>.value will have the value, and
+ * <return>.value_len its length.
+ */
+static filedict_read_t filedict_get(filedict_t *filedict, const char *key) {
+    return filedict_get_n(filedict, key, key ? strlen(key) : 0);
+}
 
-    bucket_count = header->initial_bucket_count;
+/*
+ * How many keys ahead filedict_get_many works. Each key's bucket gets prefetched twice this many
+ * keys before it's looked up, and its matching entry this many keys before.
+ */
+#ifndef FILEDICT_GET_MANY_WINDOW
+#define FILEDICT_GET_MANY_WINDOW 8
+#endif
 
-    key_hash = filedict->hash_function(key);
+/*
+ * Looks up count keys at once, leaving one read per key in results, same as filedict_get would
+ * return. Hashes everything first and prefetches buckets and entries well before they're needed,
+ * so the cache misses of different keys overlap instead of coming one after another.
+ */
+static void filedict_get_many(filedict_t *filedict, const char **keys, size_t count, filedict_read_t *results) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_read_t *read;
+    unsigned long long match;
+    size_t i, bucket_count;
 
-    /*
-     * Here we loop through each hashmap.
-     */
-    while (hashmap_i < header->hashmap_count) {
-try_again:
-        /* TODO: can we truncate instead of modulo, like in Ruby? */
-        bucket = &hashmap[key_hash % bucket_count];
+    if (filedict_refresh(filedict)) header = (filedict_header_t *)filedict->data;
+    bucket_count = header->initial_bucket_count;
 
-        for (i = 0; i < FILEDICT_BUCKET_ENTRY_COUNT; ++i) {
-            filedict_bucket_entry_t *entry = &bucket->entries[i];
+    for (i = 0; i < count; ++i) {
+        read = &results[i];
+        read->filedict = filedict;
+        read->key = keys[i];
+        read->key_len = strlen(keys[i]);
+        read->value = NULL;
+        read->value_len = 0;
+        read->value_slot = NULL;
+        read->entry = NULL;
+        read->entry_i = 0;
+        read->chain_i = 0;
+        read->bucket_count = bucket_count;
+        read->key_hash = filedict->hash_function(keys[i], read->key_len, filedict->hash_seed);
+        read->key_tag = filedict_hash_tag(read->key_hash);
+        read->bucket = &filedict_buckets(filedict)[read->key_hash % bucket_count];
+        if (i < FILEDICT_GET_MANY_WINDOW * 2) __builtin_prefetch(read->bucket, 0, 1);
+    }
 
-            /* Easy case: fresh entry. We can just insert here and call it quits. */
-            if (entry->bytes[0] == 0) {
-                size_t key_len = filedict_copy_string(entry->bytes, key, FILEDICT_BUCKET_ENTRY_BYTES);
-                size_t value_len = filedict_copy_string(entry->bytes + key_len + 1, value, FILEDICT_BUCKET_ENTRY_BYTES);
+    for (i = 0; i < count + FILEDICT_GET_MANY_WINDOW; ++i) {
+        if (i + FILEDICT_GET_MANY_WINDOW * 2 < count) {
+            __builtin_prefetch(results[i + FILEDICT_GET_MANY_WINDOW * 2].bucket, 0, 1);
+        }
 
-                if (key_len + value_len > FILEDICT_BUCKET_ENTRY_BYTES) {
-                    filedict->error = "Value too big";
-                }
-                return;
-            }
-            /*
-             * We need to check for room in the value, then append value.
-             * This is also where we might run into a duplicate and duck out.
-             */
-            else if (strncmp(entry->bytes, key, FILEDICT_BUCKET_ENTRY_BYTES) == 0) {
-                long long first_nonzero = -1;
-                char *candidate = NULL;
-                size_t bytes_i, candidate_max_len;
-
-                for (bytes_i = 0; entry->bytes[bytes_i] != 0; ++bytes_i) {
-                    if (bytes_i >= FILEDICT_BUCKET_ENTRY_BYTES) {
-                        filedict->error = "Mysterious entry overflow!! Does it contain a massive key?";
-                        return;
-                    }
-                }
+        /* Its bucket should be in cache by now, so find the entry that's likely to be its key */
+        if (i < count) {
+            read = &results[i];
+            match = filedict_bucket_match(read->bucket, read->key_tag);
+            if (match != 0) __builtin_prefetch(&read->bucket->entries[__builtin_ctzll(match)], 0, 1);
+        }
 
-                for (bytes_i += 1; bytes_i < FILEDICT_BUCKET_ENTRY_BYTES - 1; ++bytes_i) {
-                    if (unique) {
-                        if (first_nonzero == -1 && entry->bytes[bytes_i] != 0) {
-                            first_nonzero = bytes_i;
-                        }
-
-                        if (entry->bytes[bytes_i] == 0) {
-                            int cmp = strncmp(
-                                &entry->bytes[first_nonzero],
-                                value,
-                                FILEDICT_BUCKET_ENTRY_BYTES - first_nonzero
-                            );
-                            if (cmp == 0) {
-                                /* Looks like this value already exists! */
-                                return;
-                            }
-                            first_nonzero = -1;
-                        }
-                    }
+        if (i < FILEDICT_GET_MANY_WINDOW) continue;
+        read = &results[i - FILEDICT_GET_MANY_WINDOW];
+        if (!filedict_read_advance_bucket(read)) read->value = NULL;
+
+        filedict_stat_add(filedict, gets, 1);
+        filedict_stat_add(filedict, get_misses, read->value == NULL);
+        filedict_stat_histogram(filedict, get_chain_lengths, read->chain_i + 1);
+    }
+}
 
-                    if (entry->bytes[bytes_i] == 0 && entry->bytes[bytes_i + 1] == 0) {
-                        candidate = &entry->bytes[bytes_i + 1];
-                        candidate_max_len = FILEDICT_BUCKET_ENTRY_BYTES - bytes_i - 1;
+/*
+ * Lets you find the next value. Pass the return value of filedict_get.
+ *
+ * Returns 1 when a next value was found, 0 otherwise.
+ *
+ * If this returns 0, your filedict_read_t is defunct and shouldn't be used anymore.
+ */
+static int filedict_get_next(filedict_read_t *read) {
+    int found = -1;
 
-                        if (strlen(value) >= candidate_max_len) break;
+    if (read->value == NULL) return 0;
 
-                        strncpy(candidate, value, candidate_max_len);
-                        return;
-                    }
-                }
-            }
-        }
+    found = filedict_read_advance_value(read);
+    if (found == 1) return found;
 
-        ++hashmap_i;
-        hashmap += bucket_count;
-    }
+    read->entry_i += 1;
+    return filedict_read_advance_bucket(read);
+}
 
-    /*
-     * If we fell through to here, that means we need to allocate a new hashmap.
-     */
-    size_t new_hashmap_count = header->hashmap_count + 1;
-    size_t old_data_len = filedict->data_len;
-    size_t new_data_len = filedict_file_size(header->initial_bucket_count, new_hashmap_count);
+/*
+ * Hints to the kernel how we're about to read the given range of the file.
+ */
+static void filedict_advise(filedict_t *filedict, size_t start, size_t end, int advice) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
 
-    assert(new_data_len > old_data_len);
-    assert((new_data_len - old_data_len) % header->initial_bucket_count == 0);
+    start &= ~(page_size - 1);
+    if (end > filedict->data_len) end = filedict->data_len;
+    if (start >= end) return;
 
-    munmap(filedict->data, filedict->data_len);
-    int truncate_result = ftruncate(filedict->fd, new_data_len);
-    if (truncate_result != 0) { filedict->error = strerror(errno); return; }
+    madvise((char *)filedict->data + start, end - start, advice);
+}
 
-    filedict->data = mmap(
-        filedict->data,
-        new_data_len,
-        PROT_READ | ((filedict->flags & O_RDWR) ? PROT_WRITE : 0),
-        MAP_SHARED,
-        filedict->fd,
-        0
-    );
-    if (filedict->data == MAP_FAILED) { filedict->error = strerror(errno); return; }
-    header = (filedict_header_t *)filedict->data;
-    hashmap = filedict->data + old_data_len;
+/*
+ * Asks the kernel to start reading in the first fraction (0 to 1) of the file, and returns without
+ * waiting for it. The header and initial buckets come first, and every lookup starts there, so even
+ * a small fraction helps the first lookups after opening.
+ */
+static void filedict_warm(filedict_t *filedict, double fraction) {
+    if (fraction <= 0.0) return;
+    if (fraction > 1.0) fraction = 1.0;
 
-    filedict->data_len = new_data_len;
-    header->hashmap_count = new_hashmap_count;
-    goto try_again;
+    filedict_advise(filedict, 0, (size_t)((double)filedict->data_len * fraction), MADV_WILLNEED);
 }
 
 /*
- * There are 3 "levels" to a filedict. From top to bottom:
- * 1. Hashmap - which hashmap are we looking at? We create additional hashmaps to handle overflow.
- * 2. Entry   - which entry in our hashmap bucket are we looking at?
- * 3. Value   - where in the value buffer are we looking? There's 256 bytes, so can be many strings.
+ * Moves scan->bucket_offset to the next bucket with used entries. Returns 0 when there are none left.
+ *
+ * First come the initial buckets, then the overflow buckets among the blocks after them. Ranged
+ * scans only take the overflow buckets whose chain starts in their range, which we can tell from
+ * the key of any of their entries.
  */
+static int filedict_scan_advance_bucket(filedict_scan_t *scan) {
+    filedict_t *filedict = scan->filedict;
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    filedict_bucket_t *bucket;
+    filedict_block_t *block;
+    size_t head_i;
 
-/* #define log_return(val) do { printf("%s -> %i\n", __func__, (val)); return (val); } while(0) */
-#define log_return(val) return val
+    while (scan->bucket_i < scan->bucket_end) {
+        bucket = &filedict_buckets(filedict)[scan->bucket_i++];
+        scan->unvisited = filedict_bucket_live(bucket);
+
+        if (scan->unvisited != 0) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            scan->bucket_offset = (char *)bucket - (char *)filedict->data;
+            return 1;
+        }
+    }
+
+    while (scan->block_offset < scan->blocks_end) {
+        block = (filedict_block_t *)((char *)filedict->data + scan->block_offset);
+        /* Another writer is still allocating this one */
+        if (__atomic_load_n(&block->size, __ATOMIC_ACQUIRE) == 0) break;
+
+        scan->bucket_offset = scan->block_offset + sizeof(filedict_block_t);
+        scan->block_offset = scan->bucket_offset + block->size;
+        if (block->type != FILEDICT_BLOCK_BUCKET) continue;
+
+        bucket = (filedict_bucket_t *)((char *)filedict->data + scan->bucket_offset);
+        scan->unvisited = filedict_bucket_live(bucket);
+        if (scan->unvisited == 0) continue;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (scan->ranged) {
+            const char *key = bucket->entries[__builtin_ctzll(scan->unvisited)].bytes;
+
+            head_i = filedict->hash_function(key, strlen(key), filedict->hash_seed) % header->initial_bucket_count;
+            if (head_i < scan->bucket_start || head_i >= scan->bucket_end) continue;
+        }
+        return 1;
+    }
+
+    filedict_advise(filedict, filedict_file_size(scan->bucket_start), scan->blocks_end, MADV_NORMAL);
+    scan->block_offset = scan->blocks_end;
+    return 0;
+}
 
 /*
- * Returns 1 when we successfully advanced to the next value
- * Returns 0 when there is no next value
+ * Moves scan to the next value, which may be in the same entry, a later entry of the same bucket,
+ * or in a later bucket. Returns 1 when there was one, 0 when the scan is over.
  */
-static int filedict_read_advance_value(filedict_read_t *read) {
-    assert(read->entry != NULL);
+static int filedict_scan_advance(filedict_scan_t *scan) {
+    filedict_t *filedict = scan->filedict;
+    filedict_bucket_t *bucket;
+    filedict_bucket_entry_t *entry;
+    size_t entry_i, slot_i;
 
-    const char *buffer_begin = read->entry->bytes;
-    const char *buffer_end = buffer_begin + FILEDICT_BUCKET_ENTRY_BYTES;
+    while (1) {
+        if (scan->slot_offset != 0) {
+            entry = (filedict_bucket_entry_t *)((char *)filedict->data + scan->entry_offset);
+            slot_i = filedict_entry_next_value(filedict, entry, scan->slot_offset - scan->entry_offset);
+            if (slot_i != 0) break;
+        }
 
-    const char *c;
-    for (c = read->value; c < buffer_end; ++c) {
-        if (*c == 0) {
-            c += 1;
-            break;
+        if (scan->unvisited == 0 && !filedict_scan_advance_bucket(scan)) {
+            scan->key = NULL;
+            scan->value_len = 0;
+            scan->value = NULL;
+            return 0;
         }
+
+        entry_i = __builtin_ctzll(scan->unvisited);
+        scan->unvisited &= scan->unvisited - 1;
+
+        bucket = (filedict_bucket_t *)((char *)filedict->data + scan->bucket_offset);
+        entry = &bucket->entries[entry_i];
+        scan->entry_offset = entry->bytes - (char *)filedict->data;
+        scan->slot_offset = 0;
+
+        slot_i = filedict_entry_first_value(filedict, entry, strnlen(entry->bytes, FILEDICT_BUCKET_ENTRY_BYTES));
+        if (slot_i != 0) break;
     }
 
-    if (c >= buffer_end) log_return(0);
-    if (*c == 0) log_return(0);
+    scan->slot_offset = scan->entry_offset + slot_i;
+    scan->key = (char *)filedict->data + scan->entry_offset;
+    scan->value = filedict_resolve_value(filedict, &entry->bytes[slot_i]);
+    if (scan->value != NULL) {
+        scan->value_len = filedict_resolved_value_len(filedict, scan->value, &entry->bytes[slot_i]);
+        return 1;
+    }
 
-    read->value = c;
-    log_return(1);
+    /* The value was added to the heap after we mapped the file */
+    filedict_resize(filedict);
+    if (filedict->error) return 0;
+
+    scan->key = (char *)filedict->data + scan->entry_offset;
+    scan->value = filedict_resolve_value(filedict, (char *)filedict->data + scan->slot_offset);
+    if (scan->value == NULL) {
+        filedict->error = "Heap value is past the end of the file";
+        return 0;
+    }
+    scan->value_len = filedict_resolved_value_len(filedict, scan->value, (char *)filedict->data + scan->slot_offset);
+    return 1;
 }
 
 /*
- * Returns 1 when we successfully find a new entry that matches read->key.
- *           advances read->entry_i and read->entry to the new entry.
+ * Starts a scan over part range_i (out of range_count) of the dict. Every key/value pair belongs
+ * to exactly one part, so each part can be scanned by a different thread (with its own filedict_t).
  *
- * Returns 0 when we exhausted all remaining entries and didn't find a match.
+ * Like with filedict_get, <return>.value has the first value, or is NULL if there's nothing in the
+ * range. Call filedict_scan_next for the rest.
+ *
+ * The scan tells the kernel we're reading sequentially until it finishes, so that it reads ahead.
  */
-static int filedict_read_advance_entry(filedict_read_t *read) {
-    size_t value_start_i;
+#define filedict_scan(filedict) filedict_scan_range(filedict, 0, 1)
 
-    assert(read->bucket != NULL);
+static filedict_scan_t filedict_scan_range(filedict_t *filedict, size_t range_i, size_t range_count) {
+    filedict_header_t *header;
+    filedict_scan_t scan;
 
-    while (1) {
-        if (read->entry_i >= FILEDICT_BUCKET_ENTRY_COUNT) log_return(0);
+    assert(range_i < range_count);
 
-        read->entry = &read->bucket->entries[read->entry_i];
+    filedict_refresh(filedict);
+    filedict_resize(filedict);
+    header = (filedict_header_t *)filedict->data;
 
-        if (read->key == NULL) {
-            if (read->entry->bytes[0] != 0) {
-                value_start_i = strlen(read->entry->bytes) + 1;
-                read->value = &read->entry->bytes[value_start_i];
-                log_return(1);
+    memset(&scan, 0, sizeof(scan));
+    scan.filedict = filedict;
+    scan.bucket_start = header->initial_bucket_count * range_i / range_count;
+    scan.bucket_end = header->initial_bucket_count * (range_i + 1) / range_count;
+    scan.bucket_i = scan.bucket_start;
+    scan.ranged = range_count > 1;
+    scan.block_offset = filedict_file_size(header->initial_bucket_count);
+    scan.blocks_end = __atomic_load_n(&header->data_end, __ATOMIC_ACQUIRE);
+    if (scan.blocks_end > filedict->data_len) scan.blocks_end = filedict->data_len;
+
+    filedict_advise(filedict, filedict_file_size(scan.bucket_start), scan.blocks_end, MADV_SEQUENTIAL);
+
+    filedict_scan_advance(&scan);
+    return scan;
+}
+
+/*
+ * Moves the scan to the next key/value pair. Returns 1 when there is one, 0 once we're done.
+ */
+static int filedict_scan_next(filedict_scan_t *scan) {
+    if (scan->value == NULL) return 0;
+    return filedict_scan_advance(scan);
+}
+
+/*
+ * Moves the prefix scan to the first value of the next key that has the prefix. Returns 0 when
+ * there are no more.
+ */
+static int filedict_prefix_scan_advance_key(filedict_prefix_scan_t *scan) {
+    filedict_t *filedict = scan->filedict;
+    filedict_key_index_t *index;
+    filedict_key_log_t *log;
+    const char *key;
+    size_t i, key_hash, log_start;
+
+    while (1) {
+        key = NULL;
+        index = scan->index_offset ? filedict_key_index_at(filedict, scan->index_offset) : NULL;
+
+        if (index != NULL && scan->index_i < index->key_count) {
+            key = filedict_key_index_key(index, scan->index_i);
+            scan->index_i += 1;
+            /* Keys are sorted, so the first one without the prefix is the end of them */
+            if (strncmp(key, scan->prefix, scan->prefix_len) != 0) {
+                scan->index_i = index->key_count;
+                continue;
             }
         }
-        else {
-            value_start_i = filedict_string_includes(read->entry->bytes, read->key, FILEDICT_BUCKET_ENTRY_BYTES);
-
-            if (value_start_i > 0) {
-                /* add 1 because it's pointing to the 0 after key; not the first char of value */
-                value_start_i += 1;
-                read->value = &read->entry->bytes[value_start_i];
-                log_return(1);
+        else if (scan->log_i < scan->log_end) {
+            log = filedict_key_log_at(filedict, scan->log_offset);
+            key = &log->keys[scan->log_i];
+            scan->log_i += strlen(key) + 1;
+            if (strncmp(key, scan->prefix, scan->prefix_len) != 0) continue;
+
+            /* The log only has new keys, but a key can be removed and inserted again */
+            if (index != NULL) {
+                i = filedict_key_index_lower_bound(index, key);
+                if (i < index->key_count && strcmp(filedict_key_index_key(index, i), key) == 0) continue;
             }
+            key_hash = filedict_hash(filedict, key) % FILEDICT_PREFIX_SCAN_SEEN_BITS;
+            if (scan->log_seen[key_hash / 64] & (1ULL << (key_hash % 64))) {
+                log_start = scan->log_i - strlen(key) - 1;
+                for (i = 0; i < log_start; i += strlen(&log->keys[i]) + 1) {
+                    if (strcmp(&log->keys[i], key) == 0) break;
+                }
+                if (i < log_start) continue;
+            }
+            scan->log_seen[key_hash / 64] |= 1ULL << (key_hash % 64);
+        }
+        else {
+            return 0;
         }
 
-        read->entry_i += 1;
+        /* Removed keys are still in the index */
+        scan->read = filedict_get(filedict, key);
+        if (scan->read.value != NULL) {
+            scan->key = scan->read.entry->bytes;
+            scan->value = scan->read.value;
+            return 1;
+        }
+        if (filedict->error) return 0;
     }
 }
 
 /*
- * Returns 1 when we successfully advanced to the next hashmap.
- *           read->bucket, read->entry, and read->value will be populated.
+ * Starts going through the keys that start with prefix, and all of their values. <return>.value
+ * has the first value, or is NULL if no key has the prefix. Call filedict_prefix_scan_next for the
+ * rest. The prefix has to stay around until the scan is done.
  *
- * Returns 0 when there are no more hashmaps, or the latest hashmap has no matching entries.
+ * In files with FILEDICT_FEATURE_KEY_INDEX, keys come in sorted order, except those inserted since
+ * the index was last rebuilt, which come after. Other files are scanned whole.
  */
-static int filedict_read_advance_hashmap(filedict_read_t *read) {
-    filedict_t *filedict = read->filedict;
-    int success = 0;
+static filedict_prefix_scan_t filedict_prefix_scan(filedict_t *filedict, const char *prefix) {
+    filedict_header_t *header;
+    filedict_key_index_t *index;
+    filedict_prefix_scan_t scan;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.filedict = filedict;
+    scan.prefix = prefix;
+    scan.prefix_len = strlen(prefix);
+
+    filedict_refresh(filedict);
+    if (filedict->error) return scan;
+    header = (filedict_header_t *)filedict->data;
 
-    assert(filedict);
-    assert(filedict->data);
+    if (!(filedict->features & FILEDICT_FEATURE_KEY_INDEX)) {
+        for (scan.scan = filedict_scan(filedict); scan.scan.value; filedict_scan_next(&scan.scan)) {
+            if (strncmp(scan.scan.key, prefix, scan.prefix_len) == 0) break;
+        }
+        scan.key = scan.scan.key;
+        scan.value = scan.scan.value;
+        return scan;
+    }
 
-    filedict_header_t *header = (filedict_header_t*)filedict->data;
+    /* The log before the index. See filedict_key_index_rebuild. */
+    scan.log_offset = __atomic_load_n(&header->key_log_offset, __ATOMIC_ACQUIRE);
+    scan.index_offset = __atomic_load_n(&header->key_index_offset, __ATOMIC_ACQUIRE);
+    if (scan.log_offset != 0) {
+        scan.log_end = __atomic_load_n(&filedict_key_log_at(filedict, scan.log_offset)->used, __ATOMIC_ACQUIRE);
+    }
+    if (scan.index_offset != 0) {
+        index = filedict_key_index_at(filedict, scan.index_offset);
+        scan.index_i = filedict_key_index_lower_bound(index, prefix);
+    }
 
-    if (read->hashmap_i >= header->hashmap_count) log_return(0);
+    filedict_prefix_scan_advance_key(&scan);
+    return scan;
+}
 
-    size_t offset = filedict_file_size(header->initial_bucket_count, read->hashmap_i);
+/*
+ * Moves the prefix scan to the next value. Returns 1 when there is one, 0 once we're done.
+ */
+static int filedict_prefix_scan_next(filedict_prefix_scan_t *scan) {
+    if (scan->value == NULL) return 0;
 
-    if (offset >= filedict->data_len) {
-        filedict_resize(filedict);
-        if (filedict->error) log_return(0);
-        header = (filedict_header_t*)filedict->data;
+    if (!(scan->filedict->features & FILEDICT_FEATURE_KEY_INDEX)) {
+        while (filedict_scan_next(&scan->scan)) {
+            if (strncmp(scan->scan.key, scan->prefix, scan->prefix_len) == 0) break;
+        }
+        scan->key = scan->scan.key;
+        scan->value = scan->scan.value;
+        return scan->value != NULL;
     }
 
-    filedict_bucket_t *hashmap = filedict->data + offset;
+    if (filedict_get_next(&scan->read)) {
+        scan->key = scan->read.entry->bytes;
+        scan->value = scan->read.value;
+        return 1;
+    }
 
-    read->bucket_count = (size_t)header->initial_bucket_count;
-    read->bucket = &hashmap[read->key_hash % read->bucket_count];
-    read->entry = &read->bucket->entries[0];
+    if (filedict_prefix_scan_advance_key(scan)) return 1;
+    scan->key = NULL;
+    scan->value = NULL;
+    return 0;
+}
 
-    read->entry_i = 0;
+/*
+ * Returns the number of the latest change recorded in the file, or 0 if it doesn't have a change
+ * log. filedict_changes_since that number gives only what comes after now.
+ */
+static unsigned long long filedict_change_seq(filedict_t *filedict) {
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
 
-    if (read->key == NULL) {
-        success = filedict_read_advance_entry(read);
-        while (!success) {
-            read->key_hash += 1;
-            read->bucket = &hashmap[read->key_hash % read->bucket_count];
-            read->entry = &read->bucket->entries[0];
-            read->entry_i = 0;
-            success = filedict_read_advance_entry(read);
-            if (read->key_hash >= read->bucket_count) return 0;
+    if (!(filedict->features & FILEDICT_FEATURE_CHANGE_LOG)) return 0;
+    return __atomic_load_n(&header->change_seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the entry and value slot a change points at, or NULL if that entry has been removed
+ * since or the slot no longer starts a value.
+ */
+static filedict_bucket_entry_t *filedict_change_entry(filedict_t *filedict, size_t bucket_offset, size_t entry_i, size_t slot_i) {
+    filedict_bucket_t *bucket;
+    filedict_bucket_entry_t *entry;
+    size_t value_i;
+
+    if (entry_i >= FILEDICT_BUCKET_ENTRY_COUNT) return NULL;
+    bucket = filedict_bucket_at(filedict, bucket_offset);
+    if (bucket == NULL) return NULL;
+    if (__atomic_load_n(&bucket->tags[entry_i], __ATOMIC_ACQUIRE) < FILEDICT_TAG_MIN) return NULL;
+
+    entry = &bucket->entries[entry_i];
+    value_i = filedict_entry_first_value(filedict, entry, strnlen(entry->bytes, FILEDICT_BUCKET_ENTRY_BYTES));
+    for (; value_i != 0 && value_i < slot_i; value_i = filedict_entry_next_value(filedict, entry, value_i));
+
+    return value_i == slot_i ? entry : NULL;
+}
+
+/*
+ * Moves changes to the next change. Returns 1 when there is one, 0 once we've caught up. After
+ * that, changes->seq is what to pass to filedict_changes_since next time.
+ *
+ * Sets changes->lost when changes got overwritten before we could get to them, and carries on
+ * from the oldest one still in the log. Then the only way to be sure of having everything is to
+ * read the whole dict again.
+ */
+static int filedict_changes_next(filedict_changes_t *changes) {
+    filedict_t *filedict = changes->filedict;
+    filedict_header_t *header = (filedict_header_t *)filedict->data;
+    size_t change_log_offset = __atomic_load_n(&header->change_log_offset, __ATOMIC_ACQUIRE);
+    unsigned long long wanted, record_seq, latest, bucket_offset;
+    unsigned int entry_i, slot_i;
+    filedict_change_t *change;
+    filedict_bucket_entry_t *entry;
+
+    changes->key = NULL;
+    changes->value = NULL;
+    if (change_log_offset == 0) return 0;
+
+    while (filedict->error == NULL) {
+        /* Looking at an entry can remap */
+        header = (filedict_header_t *)filedict->data;
+        latest = __atomic_load_n(&header->change_seq, __ATOMIC_ACQUIRE);
+        if (changes->seq >= latest) return 0;
+
+        wanted = changes->seq + 1;
+        change = (filedict_change_t *)((char *)filedict->data + change_log_offset) + (wanted - 1) % header->change_log_records;
+
+        record_seq = __atomic_load_n(&change->seq, __ATOMIC_ACQUIRE);
+        /* Its writer is still filling it in */
+        if (record_seq < wanted) return 0;
+
+        bucket_offset = change->bucket_offset;
+        entry_i = change->entry_i;
+        slot_i = change->slot_i;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (record_seq > wanted || __atomic_load_n(&change->seq, __ATOMIC_RELAXED) != wanted) {
+            changes->lost = 1;
+            latest = __atomic_load_n(&header->change_seq, __ATOMIC_ACQUIRE);
+            changes->seq = latest > header->change_log_records ? latest - header->change_log_records : wanted;
+            continue;
         }
-        return success;
+        changes->seq = wanted;
+
+        entry = filedict_change_entry(filedict, bucket_offset, entry_i, slot_i);
+        if (entry == NULL) continue;
+
+        changes->value = filedict_resolve_value(filedict, &entry->bytes[slot_i]);
+        if (changes->value == NULL) continue;
+        changes->key = entry->bytes;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Starts going through the changes after change number seq: 0 for every change still in the log,
+ * or a changes->seq from before to pick up where that left off. <return>.key and .value have the
+ * first change, or are NULL if there isn't one. Call filedict_changes_next for the rest.
+ *
+ * Only files with FILEDICT_FEATURE_CHANGE_LOG have changes. Removals aren't recorded, and changes
+ * whose values have been removed since are skipped. Once an entry is removed, a later key can reuse
+ * it, so a change can also point at a value inserted after it. Apply changes so that seeing one
+ * twice does no harm.
+ */
+static filedict_changes_t filedict_changes_since(filedict_t *filedict, unsigned long long seq) {
+    filedict_changes_t changes;
+
+    memset(&changes, 0, sizeof(changes));
+    changes.filedict = filedict;
+    changes.seq = seq;
+
+    filedict_refresh(filedict);
+    if (filedict->error) return changes;
+    if (!(filedict->features & FILEDICT_FEATURE_CHANGE_LOG)) return changes;
+
+    /* The file was made again since we saw change seq, so none of what we saw is in it */
+    if (seq > filedict_change_seq(filedict)) {
+        changes.lost = 1;
+        changes.seq = 0;
     }
 
-    log_return(filedict_read_advance_entry(read));
+    filedict_changes_next(&changes);
+    return changes;
 }
 
 /*
- * Returns a "read" at the given key. If there's a hit, <return>.value will have the value.
+ * The first-level hash of a frozen file, which picks the key's displacement, and the slot a key's
+ * hash and displacement lead to. Both scramble the key hash with the splitmix64 finalizer (each
+ * mixed in differently), so which displacement a key gets says nothing about its slot.
  */
-static filedict_read_t filedict_get(filedict_t *filedict, const char *key) {
-    filedict_read_t read;
+static unsigned long long filedict_frozen_mix(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+#define filedict_frozen_displacement_i(key_hash, displacement_count) \
+    (filedict_frozen_mix((unsigned long long)(key_hash) ^ 0x66726f7a656eULL) % (displacement_count))
+
+#define filedict_frozen_slot(key_hash, displacement, key_count) \
+    (filedict_frozen_mix((unsigned long long)(key_hash) + (unsigned long long)(displacement) * 0x9E3779B97F4A7C15ULL) % (key_count))
+
+#define filedict_frozen_hash(header, key, key_len) filedict_wyhash64((key), (key_len), (header)->frozen_seed)
+
+#define FILEDICT_FROZEN_OFFSET_BITS 48
+#define filedict_frozen_fingerprint(key_hash) (filedict_frozen_mix(key_hash) >> FILEDICT_FROZEN_OFFSET_BITS)
+#define filedict_frozen_record_offset(slot) ((slot) & ((1ULL << FILEDICT_FROZEN_OFFSET_BITS) - 1))
+
+/*
+ * Opens a file made by ./freeze. Use filedict_frozen_get instead of filedict_get on it, and
+ * filedict_deinit when you're done.
+ */
+static void filedict_open_frozen(filedict_t *filedict, const char *filename) {
+    filedict_frozen_header_t *header;
+    struct stat info;
+
+    filedict->flags = O_RDONLY;
+    filedict->fd = open(filename, O_RDONLY);
+    if (filedict->fd == -1) { filedict->error = strerror(errno); return; }
+    if (fstat(filedict->fd, &info) != 0) { filedict->error = strerror(errno); return; }
+
+    if ((size_t)info.st_size < sizeof(filedict_frozen_header_t)) {
+        filedict->error = "Not a frozen filedict file (too small)";
+        return;
+    }
+
+    filedict->data = mmap(
+        NULL,
+        info.st_size,
+        PROT_READ,
+        MAP_SHARED | ((filedict->map_options & FILEDICT_MAP_POPULATE) ? MAP_POPULATE : 0),
+        filedict->fd,
+        0
+    );
+    if (filedict->data == MAP_FAILED) {
+        filedict->data = NULL;
+        filedict->error = strerror(errno);
+        return;
+    }
+    filedict->data_len = info.st_size;
+    filedict->address_space_len = info.st_size;
+
+    header = (filedict_frozen_header_t *)filedict->data;
+    if (header->magic != FILEDICT_FROZEN_MAGIC) {
+        filedict->error = "Not a frozen filedict file";
+        return;
+    }
+    if (header->version != FILEDICT_FROZEN_VERSION) {
+        filedict->error = "Unsupported frozen filedict version";
+        return;
+    }
+    if (header->hash_id >= FILEDICT_HASH_COUNT) {
+        filedict->error = "Unknown hash function in filedict header";
+        return;
+    }
+    if (header->records_end > filedict->data_len ||
+        header->displacements_offset + header->displacement_count * 4 > header->slots_offset ||
+        header->slots_offset + header->key_count * 8 > header->records_end ||
+        (header->key_count != 0 && header->displacement_count == 0)) {
+        filedict->error = "Frozen filedict file is truncated";
+        return;
+    }
+
+    filedict->hash_id = header->hash_id;
+    filedict->hash_seed = header->hash_seed;
+    filedict->hash_function = filedict_hash_functions[header->hash_id];
+    filedict->features = 0;
+
+    /* A lookup reads its displacement and slot before its record */
+    filedict_apply_map_options(filedict, 0, filedict->data_len, header->slots_offset + header->key_count * 8);
+}
+
+/*
+ * Points read at the first value of the record in slot slot_i.
+ */
+static void filedict_frozen_read_record(filedict_frozen_read_t *read, size_t slot_i) {
+    filedict_frozen_header_t *header = (filedict_frozen_header_t *)read->filedict->data;
+    const unsigned long long *slots = (const unsigned long long *)((char *)read->filedict->data + header->slots_offset);
+    const char *record = (char *)read->filedict->data + filedict_frozen_record_offset(slots[slot_i]);
+
+    read->values_left = *(const unsigned int *)record;
+    read->key = record + sizeof(unsigned int);
+    read->value = read->key + strlen(read->key) + 1;
+}
+
+/*
+ * Returns a read at the given key, like filedict_get. <return>.value is NULL if the key isn't in
+ * the file. Pass NULL as the key to go through every key and value of the file.
+ */
+static filedict_frozen_read_t filedict_frozen_get(filedict_t *filedict, const char *key) {
+    filedict_frozen_header_t *header = (filedict_frozen_header_t *)filedict->data;
+    const unsigned int *displacements = (const unsigned int *)((char *)filedict->data + header->displacements_offset);
+    const unsigned long long *slots = (const unsigned long long *)((char *)filedict->data + header->slots_offset);
+    filedict_frozen_read_t read;
+    unsigned long long key_hash;
+    size_t slot_i;
+
+    memset(&read, 0, sizeof(read));
     read.filedict = filedict;
-    read.key = key;
-    read.value = NULL;
-    read.bucket = NULL;
-    read.entry = NULL;
-    read.entry_i = 0;
-    read.hashmap_i = 0;
-    read.bucket_count = 0;
+    if (header->key_count == 0) return read;
 
-    /* NULL key means we want to iterate the whole entire dictionary */
     if (key == NULL) {
-        read.key_hash = 0;
-    }
-    else {
-        read.key_hash = filedict->hash_function(key);
+        read.all_keys = 1;
+        read.next_slot = 1;
+        filedict_frozen_read_record(&read, 0);
+        return read;
     }
 
-    filedict_read_advance_hashmap(&read);
+    key_hash = filedict_frozen_hash(header, key, strlen(key));
+    slot_i = filedict_frozen_slot(
+        key_hash,
+        displacements[filedict_frozen_displacement_i(key_hash, header->displacement_count)],
+        header->key_count
+    );
+    if (slots[slot_i] >> FILEDICT_FROZEN_OFFSET_BITS != filedict_frozen_fingerprint(key_hash)) return read;
+
+    filedict_frozen_read_record(&read, slot_i);
+
+    /* Someone else's record */
+    if (strcmp(read.key, key) != 0) {
+        read.key = NULL;
+        read.value = NULL;
+        read.values_left = 0;
+    }
     return read;
 }
 
 /*
- * Lets you find the next value. Pass the return value of filedict_get.
- *
- * Returns 1 when a next value was found, 0 otherwise.
- *
- * If this returns 0, your filedict_read_t is defunct and shouldn't be used anymore.
+ * Moves read to the next value, like filedict_get_next. Returns 1 when there was one.
  */
-static int filedict_get_next(filedict_read_t *read) {
-    int found = -1;
+static int filedict_frozen_get_next(filedict_frozen_read_t *read) {
+    filedict_frozen_header_t *header = (filedict_frozen_header_t *)read->filedict->data;
 
-    found = filedict_read_advance_value(read);
-    if (found == 1) return found;
+    if (read->value == NULL) return 0;
 
-    read->entry_i += 1;
-    found = filedict_read_advance_entry(read);
-    if (found == 1) return found;
+    if (read->values_left > 1) {
+        read->values_left -= 1;
+        read->value += strlen(read->value) + 1;
+        return 1;
+    }
 
-    /*
-     * If read->key is NULL, that means we're iterating through the whole dict.
-     */
-    if (read->key == NULL) {
-        read->key_hash += 1;
-        if (read->key_hash < read->bucket_count) {
-            return filedict_read_advance_hashmap(read);
-        }
-        else {
-            read->key_hash = 0;
-        }
+    if (read->all_keys && read->next_slot < header->key_count) {
+        filedict_frozen_read_record(read, read->next_slot++);
+        return 1;
     }
 
-    read->hashmap_i += 1;
-    return filedict_read_advance_hashmap(read);
+    read->value = NULL;
+    read->values_left = 0;
+    return 0;
+}
+
+#ifdef FILEDICT_STATS
+#include <stdio.h>
+
+static void filedict_stats_reset(filedict_t *filedict) {
+    memset(&filedict->stats, 0, sizeof(filedict->stats));
+}
+
+static void filedict_stats_dump_histogram(FILE *out, const char *label, unsigned long long *histogram) {
+    unsigned long long total = 0, weighted = 0;
+    size_t i;
+
+    for (i = 0; i < FILEDICT_STATS_HISTOGRAM_SIZE; ++i) {
+        total += histogram[i];
+        weighted += histogram[i] * i;
+    }
+    fprintf(out, "%s (average %.2f buckets):\n", label, total ? (double)weighted / (double)total : 0.0);
+
+    for (i = 1; i < FILEDICT_STATS_HISTOGRAM_SIZE; ++i) {
+        if (histogram[i] == 0) continue;
+        fprintf(
+            out, "  %2zu%s %12llu  %6.2f%%\n",
+            i, i == FILEDICT_STATS_HISTOGRAM_SIZE - 1 ? "+" : " ",
+            histogram[i], (double)histogram[i] / (double)total * 100.0
+        );
+    }
 }
 
+/*
+ * Prints everything counted since filedict_init (or filedict_stats_reset). Long chains mean the file
+ * could use compacting, or a bigger initial_bucket_count.
+ */
+static void filedict_stats_dump(filedict_t *filedict, FILE *out) {
+    filedict_stats_t *stats = &filedict->stats;
+
+    fprintf(out, "gets:                   %llu (%llu misses)\n", stats->gets, stats->get_misses);
+    fprintf(out, "tag matches:            %llu (%llu false positives)\n", stats->tag_matches, stats->tag_false_positives);
+    fprintf(out, "value bytes scanned:    %llu\n", stats->value_bytes_scanned);
+    fprintf(out, "inserts:                %llu\n", stats->inserts);
+    fprintf(out, "overflow buckets added: %llu\n", stats->overflow_buckets_added);
+    fprintf(out, "chain filter skips:     %llu\n", stats->chain_filter_skips);
+    fprintf(out, "file growths:           %llu\n", stats->file_growths);
+    fprintf(out, "remaps:                 %llu\n", stats->remaps);
+    filedict_stats_dump_histogram(out, "get chain lengths", stats->get_chain_lengths);
+    filedict_stats_dump_histogram(out, "insert chain lengths", stats->insert_chain_lengths);
+}
 #endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,317 @@
+#ifndef FILEDICT_HPP
+#define FILEDICT_HPP 1
+
+/*
+ * A C++17 wrapper around filedict.h. Handles close their file when they go away, keys and values
+ * go in and come out as std::string_view (pointing straight into the mapping, no copies), and
+ * values can be gone through with range-for:
+ *
+ *     filedict::dict dict("index.fdict");
+ *     dict.insert("key", "value");
+ *     for (std::string_view value : dict.get("key")) { ... }
+ *     for (auto item : dict.items()) { ... item.key ... item.value ... }
+ *
+ * Failures throw filedict::error with the message filedict.h would have left in filedict->error.
+ * Like there, an error sticks: everything after it throws too. Keys and values with NUL bytes in
+ * them throw as well, but leave the handle usable.
+ */
+
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "filedict.h"
+
+namespace filedict {
+
+/*
+ * Hash policies: which of filedict.h's hash functions a dict type uses. New files are created with
+ * it, and opening a file made with a different one throws.
+ */
+struct djb2_hash {
+    static constexpr unsigned int id = FILEDICT_HASH_DJB2;
+};
+
+struct wyhash_hash {
+    static constexpr unsigned int id = FILEDICT_HASH_WYHASH;
+};
+
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+enum class open_mode {
+    /* O_RDONLY */
+    read_only,
+    /* O_CREAT | O_RDWR */
+    read_write,
+    /* O_CREAT | O_TRUNC | O_RDWR, so any existing contents are thrown away */
+    truncate,
+};
+
+/*
+ * What to open a file with. bucket_count, features and hash_seed only matter for new files, the
+ * rest are the filedict_t fields of the same name.
+ */
+struct options {
+    unsigned int bucket_count = 4096;
+    unsigned int features = 0;
+    unsigned long long hash_seed = FILEDICT_DEFAULT_HASH_SEED;
+    unsigned int map_options = 0;
+    unsigned int durability = FILEDICT_DURABILITY_NONE;
+};
+
+/* What every range's end() returns. Iterators know on their own when they're done. */
+struct end_iterator {};
+
+/*
+ * The values of one key, as returned by basic_dict::get. An empty range means the key isn't there.
+ */
+class value_range {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = std::string_view;
+
+        explicit iterator(const filedict_read_t &read) : read_(read), done_(read.value == nullptr) {}
+
+        std::string_view operator*() const { return std::string_view(read_.value, read_.value_len); }
+
+        iterator &operator++() {
+            done_ = !filedict_get_next(&read_);
+            return *this;
+        }
+
+        bool operator==(end_iterator) const { return done_; }
+        bool operator!=(end_iterator) const { return !done_; }
+
+    private:
+        filedict_read_t read_;
+        bool done_;
+    };
+
+    explicit value_range(const filedict_read_t &read) : read_(read) {}
+
+    iterator begin() const { return iterator(read_); }
+    end_iterator end() const { return end_iterator(); }
+
+    bool empty() const { return read_.value == nullptr; }
+
+    /* The first value. Only call this when the range isn't empty. */
+    std::string_view front() const { return std::string_view(read_.value, read_.value_len); }
+
+private:
+    filedict_read_t read_;
+};
+
+struct item {
+    std::string_view key;
+    std::string_view value;
+};
+
+/*
+ * Every key/value pair in the file, in the order they sit in it. See filedict_scan.
+ */
+class item_range {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = item;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const item *;
+        using reference = item;
+
+        explicit iterator(const filedict_scan_t &scan) : scan_(scan), key_(nullptr), key_len_(0) {}
+
+        item operator*() {
+            /* All values of an entry come one after another, so the key's length carries over */
+            if (scan_.key != key_) {
+                key_ = scan_.key;
+                key_len_ = strlen(key_);
+            }
+            return item{std::string_view(key_, key_len_), std::string_view(scan_.value, scan_.value_len)};
+        }
+
+        iterator &operator++() {
+            filedict_scan_next(&scan_);
+            return *this;
+        }
+
+        bool operator==(end_iterator) const { return scan_.value == nullptr; }
+        bool operator!=(end_iterator) const { return scan_.value != nullptr; }
+
+    private:
+        filedict_scan_t scan_;
+        const char *key_;
+        size_t key_len_;
+    };
+
+    explicit item_range(const filedict_scan_t &scan) : scan_(scan) {}
+
+    iterator begin() const { return iterator(scan_); }
+    end_iterator end() const { return end_iterator(); }
+
+private:
+    filedict_scan_t scan_;
+};
+
+/*
+ * An open filedict file. Only movable, since it owns the file descriptor and the mapping. Ranges
+ * point at the handle they came from, so don't move it while going through one.
+ *
+ * The bucket geometry is part of the file format but isn't recorded in the file, and filedict.h
+ * fixes it for the whole translation unit with FILEDICT_BUCKET_ENTRY_BYTES and
+ * FILEDICT_BUCKET_ENTRY_COUNT. EntryBytes and EntryCount spell out the geometry a dict type
+ * expects, so code written for one geometry doesn't build against another. Everything sized by
+ * it, like the tag comparisons in filedict_bucket_match, is already a compile-time constant.
+ */
+template <
+    size_t EntryBytes = FILEDICT_BUCKET_ENTRY_BYTES,
+    size_t EntryCount = FILEDICT_BUCKET_ENTRY_COUNT,
+    class Hash = wyhash_hash
+>
+class basic_dict {
+    static_assert(EntryBytes == FILEDICT_BUCKET_ENTRY_BYTES, "filedict.h was included with a different FILEDICT_BUCKET_ENTRY_BYTES");
+    static_assert(EntryCount == FILEDICT_BUCKET_ENTRY_COUNT, "filedict.h was included with a different FILEDICT_BUCKET_ENTRY_COUNT");
+
+public:
+    static constexpr size_t entry_bytes = EntryBytes;
+    static constexpr size_t entry_count = EntryCount;
+    static constexpr size_t bucket_bytes = sizeof(filedict_bucket_t);
+    using hash = Hash;
+
+    explicit basic_dict(const char *path, open_mode mode = open_mode::read_write, const options &opts = options()) {
+        int flags = O_CREAT | O_RDWR;
+
+        if (mode == open_mode::read_only) flags = O_RDONLY;
+        else if (mode == open_mode::truncate) flags = O_CREAT | O_TRUNC | O_RDWR;
+
+        filedict_init(&filedict_);
+        filedict_.hash_id = Hash::id;
+        filedict_.hash_seed = opts.hash_seed;
+        filedict_.features = opts.features;
+        filedict_.map_options = opts.map_options;
+        filedict_.durability = opts.durability;
+        filedict_open_f(&filedict_, path, flags, opts.bucket_count);
+
+        if (filedict_.error == nullptr && filedict_.hash_id != Hash::id) {
+            filedict_.error = "File was made with a different hash function";
+        }
+        if (filedict_.error) {
+            const char *message = filedict_.error;
+            filedict_deinit(&filedict_);
+            throw error(message);
+        }
+    }
+
+    explicit basic_dict(const std::string &path, open_mode mode = open_mode::read_write, const options &opts = options())
+        : basic_dict(path.c_str(), mode, opts) {}
+
+    basic_dict(const basic_dict &) = delete;
+    basic_dict &operator=(const basic_dict &) = delete;
+
+    basic_dict(basic_dict &&other) noexcept : filedict_(other.filedict_) {
+        filedict_init(&other.filedict_);
+    }
+
+    basic_dict &operator=(basic_dict &&other) noexcept {
+        if (this != &other) {
+            filedict_deinit(&filedict_);
+            filedict_ = other.filedict_;
+            filedict_init(&other.filedict_);
+        }
+        return *this;
+    }
+
+    ~basic_dict() { filedict_deinit(&filedict_); }
+
+    void insert(std::string_view key, std::string_view value) {
+        check_bytes(key);
+        check_bytes(value);
+        filedict_insert_n(&filedict_, data_of(key), key.size(), data_of(value), value.size());
+        check();
+    }
+
+    /* Only inserts value if key doesn't have it yet */
+    void insert_unique(std::string_view key, std::string_view value) {
+        check_bytes(key);
+        check_bytes(value);
+        filedict_insert_unique_n(&filedict_, data_of(key), key.size(), data_of(value), value.size());
+        check();
+    }
+
+    value_range get(std::string_view key) {
+        check_bytes(key);
+        filedict_read_t read = filedict_get_n(&filedict_, data_of(key), key.size());
+        check();
+        return value_range(read);
+    }
+
+    bool contains(std::string_view key) { return !get(key).empty(); }
+
+    item_range items() {
+        filedict_scan_t scan = filedict_scan(&filedict_);
+        check();
+        return item_range(scan);
+    }
+
+    /*
+     * Removes key and all of its values, or just one of its values. Returns how many values were
+     * removed. filedict_remove_f wants NUL-terminated strings, so these are copied.
+     */
+    size_t remove(std::string_view key) {
+        check_bytes(key);
+        size_t removed = filedict_remove(&filedict_, std::string(key).c_str());
+        check();
+        return removed;
+    }
+
+    size_t remove(std::string_view key, std::string_view value) {
+        check_bytes(key);
+        check_bytes(value);
+        size_t removed = filedict_remove_value(&filedict_, std::string(key).c_str(), std::string(value).c_str());
+        check();
+        return removed;
+    }
+
+    /* See filedict_commit */
+    void commit() {
+        filedict_commit(&filedict_);
+        check();
+    }
+
+    /* The underlying filedict_t, for everything this doesn't wrap */
+    filedict_t *raw() { return &filedict_; }
+
+private:
+    /* A default std::string_view has no data, and a NULL key means something else to filedict.h */
+    static const char *data_of(std::string_view view) { return view.data() ? view.data() : ""; }
+
+    /*
+     * Strings in the file end at their first NUL, so one with a NUL inside would come back cut
+     * short, or match a different key. filedict.h refuses them too, but by setting the sticky error.
+     */
+    static void check_bytes(std::string_view view) {
+        if (view.find('\0') != std::string_view::npos) throw error("Keys and values can't contain NUL bytes");
+    }
+
+    void check() const {
+        if (filedict_.error) throw error(filedict_.error);
+    }
+
+    filedict_t filedict_;
+};
+
+using dict = basic_dict<>;
+
+} /* namespace filedict */
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+#include "filedict.h"
+
+#define error_check(filedict) do { if (filedict.error) { printf("[%i] error: %s\n", __LINE__, filedict.error); filedict_deinit(&filedict); return 2; } } while (0)
+
+/*
+ * Average number of keys that share a displacement. More means a smaller file, but each
+ * displacement gets harder to find.
+ */
+#define KEYS_PER_DISPLACEMENT 4
+
+/*
+ * How many seeds to try before giving up on giving every key a different hash. With 64-bit hashes,
+ * even the first one almost never has a collision.
+ */
+#define SEED_ATTEMPTS 16
+
+typedef struct freeze_key_t {
+    unsigned long long hash;
+    /* Where the key is in src's mapping */
+    size_t offset;
+    size_t len;
+    size_t displacement_i;
+    /* Before deduplicating, which entry of the scan this was. After, where its values start. */
+    size_t first;
+    size_t value_count;
+} freeze_key_t;
+
+/* A value, where it is in src's mapping */
+typedef struct freeze_value_t {
+    size_t offset;
+    size_t len;
+} freeze_value_t;
+
+static const char *src_data;
+
+static int compare_keys(const void *a, const void *b) {
+    const freeze_key_t *key_a = (const freeze_key_t *)a, *key_b = (const freeze_key_t *)b;
+
+    if (key_a->hash != key_b->hash) return key_a->hash < key_b->hash ? -1 : 1;
+    return strcmp(src_data + key_a->offset, src_data + key_b->offset);
+}
+
+static size_t *group_sizes;
+
+static int compare_groups(const void *a, const void *b) {
+    size_t size_a = group_sizes[*(const size_t *)a], size_b = group_sizes[*(const size_t *)b];
+
+    if (size_a != size_b) return size_a > size_b ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Hashes every key with seed and sorts them by hash. Returns 0 if two different keys got the same
+ * hash, which would leave no way to tell them apart.
+ */
+static int hash_keys(freeze_key_t *keys, size_t count, unsigned long long seed) {
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        keys[i].hash = filedict_wyhash64(src_data + keys[i].offset, keys[i].len, seed);
+    }
+    qsort(keys, count, sizeof(freeze_key_t), compare_keys);
+
+    for (i = 1; i < count; ++i) {
+        if (keys[i - 1].hash == keys[i].hash && strcmp(src_data + keys[i - 1].offset, src_data + keys[i].offset) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Collects every distinct key of the file and all of their values in one scan, which reads the
+ * file front to back. Picks a seed that gives every key a different hash, and returns how many
+ * keys there are, sorted by hash. Each key's values are in *values_out, in file order. That's the
+ * order filedict_get returns them in, since a chain's overflow buckets always come after it.
+ * Returns 0 with *error set if something went wrong.
+ */
+static size_t collect_keys(
+    filedict_t *src,
+    freeze_key_t **keys_out,
+    freeze_value_t **values_out,
+    unsigned long long *seed_out,
+    const char **error
+) {
+    freeze_key_t *keys = NULL;
+    freeze_value_t *values = NULL, *sorted_values;
+    /* For each value, the entry it was in. Then for each entry, the key it has. */
+    size_t *value_entries = NULL, *entry_keys;
+    size_t entry_count = 0, key_capacity = 0, value_count = 0, value_capacity = 0, i, unique, attempt;
+    unsigned long long seed = FILEDICT_DEFAULT_HASH_SEED;
+    filedict_scan_t scan;
+    const char *last_key = NULL;
+
+    src_data = (const char *)src->data;
+
+    for (scan = filedict_scan(src); scan.value; filedict_scan_next(&scan)) {
+        /* The values of one entry come one after another */
+        if (scan.key != last_key) {
+            last_key = scan.key;
+            if (entry_count == key_capacity) {
+                key_capacity = key_capacity ? key_capacity * 2 : 1024;
+                keys = realloc(keys, key_capacity * sizeof(freeze_key_t));
+            }
+            keys[entry_count].offset = scan.key - src_data;
+            keys[entry_count].len = strlen(scan.key);
+            keys[entry_count].first = entry_count;
+            keys[entry_count].value_count = 0;
+            entry_count += 1;
+        }
+
+        if (value_count == value_capacity) {
+            value_capacity = value_capacity ? value_capacity * 2 : 1024;
+            values = realloc(values, value_capacity * sizeof(freeze_value_t));
+            value_entries = realloc(value_entries, value_capacity * sizeof(size_t));
+        }
+        values[value_count].offset = scan.value - src_data;
+        values[value_count].len = scan.value_len;
+        value_entries[value_count] = entry_count - 1;
+        value_count += 1;
+    }
+    if (src->error) *error = src->error;
+
+    for (attempt = 0; *error == NULL && !hash_keys(keys, entry_count, seed); ++attempt) {
+        if (attempt + 1 == SEED_ATTEMPTS) *error = "Couldn't find a seed that gives every key a different hash";
+        seed = filedict_frozen_mix(seed + 1);
+    }
+    if (*error) {
+        free(keys);
+        free(values);
+        free(value_entries);
+        return 0;
+    }
+
+    /* A key can have more than one entry. Those are next to each other now. */
+    entry_keys = malloc((entry_count ? entry_count : 1) * sizeof(size_t));
+    for (i = 0, unique = 0; i < entry_count; ++i) {
+        if (unique == 0 || strcmp(src_data + keys[unique - 1].offset, src_data + keys[i].offset) != 0) {
+            keys[unique++] = keys[i];
+        }
+        entry_keys[keys[i].first] = unique - 1;
+    }
+
+    /* Group the values by key, keeping them in file order */
+    for (i = 0; i < unique; ++i) keys[i].value_count = 0;
+    for (i = 0; i < value_count; ++i) keys[entry_keys[value_entries[i]]].value_count += 1;
+    for (i = 0, entry_count = 0; i < unique; ++i) {
+        keys[i].first = entry_count;
+        entry_count += keys[i].value_count;
+    }
+    sorted_values = malloc((value_count ? value_count : 1) * sizeof(freeze_value_t));
+    for (i = 0; i < unique; ++i) keys[i].value_count = 0;
+    for (i = 0; i < value_count; ++i) {
+        freeze_key_t *key = &keys[entry_keys[value_entries[i]]];
+        sorted_values[key->first + key->value_count++] = values[i];
+    }
+
+    free(values);
+    free(value_entries);
+    free(entry_keys);
+
+    *keys_out = keys;
+    *values_out = sorted_values;
+    *seed_out = seed;
+    return unique;
+}
+
+/*
+ * Finds a displacement for every group of keys, so that all keys end up in different slots.
+ * Big groups go first, while most slots are still free. Fills in slot_keys (the key in each slot).
+ */
+static void place_keys(
+    freeze_key_t *keys,
+    size_t key_count,
+    unsigned int *displacements,
+    size_t displacement_count,
+    size_t *slot_keys
+) {
+    size_t *group_starts = calloc(displacement_count + 1, sizeof(size_t));
+    size_t *group_keys = malloc(key_count * sizeof(size_t));
+    size_t *order = malloc(displacement_count * sizeof(size_t));
+    size_t *slots = malloc(key_count * sizeof(size_t));
+    unsigned char *taken = calloc(key_count, 1);
+    size_t i, j, g, group, group_size;
+    unsigned int displacement;
+
+    group_sizes = calloc(displacement_count, sizeof(size_t));
+    for (i = 0; i < key_count; ++i) {
+        keys[i].displacement_i = filedict_frozen_displacement_i(keys[i].hash, displacement_count);
+        group_sizes[keys[i].displacement_i] += 1;
+    }
+    for (g = 0; g < displacement_count; ++g) {
+        group_starts[g + 1] = group_starts[g] + group_sizes[g];
+        order[g] = g;
+    }
+    for (i = 0; i < key_count; ++i) {
+        group_keys[group_starts[keys[i].displacement_i]++] = i;
+    }
+    /* group_starts moved to where each group ends, which is where the next one starts */
+    memmove(group_starts + 1, group_starts, displacement_count * sizeof(size_t));
+    group_starts[0] = 0;
+
+    qsort(order, displacement_count, sizeof(size_t), compare_groups);
+
+    for (g = 0; g < displacement_count && group_sizes[order[g]] > 0; ++g) {
+        group = order[g];
+        group_size = group_sizes[group];
+
+        for (displacement = 0;; ++displacement) {
+            for (i = 0; i < group_size; ++i) {
+                slots[i] = filedict_frozen_slot(keys[group_keys[group_starts[group] + i]].hash, displacement, key_count);
+                if (taken[slots[i]]) break;
+                taken[slots[i]] = 1;
+            }
+            if (i == group_size) break;
+
+            /* Collided with a slot that's taken, maybe by this group. Give back what we took. */
+            for (j = 0; j < i; ++j) taken[slots[j]] = 0;
+        }
+
+        displacements[group] = displacement;
+        for (i = 0; i < group_size; ++i) slot_keys[slots[i]] = group_keys[group_starts[group] + i];
+    }
+
+    free(group_sizes);
+    free(group_starts);
+    free(group_keys);
+    free(order);
+    free(slots);
+    free(taken);
+}
+
+/*
+ * Returns how many bytes the key's record takes up, padding included.
+ */
+static size_t record_size(freeze_key_t *key, freeze_value_t *values) {
+    size_t size = sizeof(unsigned int) + key->len + 1, i;
+
+    for (i = 0; i < key->value_count; ++i) size += values[key->first + i].len + 1;
+    return (size + 3) & ~(size_t)3;
+}
+
+static void write_record(freeze_key_t *key, freeze_value_t *values, FILE *out) {
+    static const char padding[4] = { 0, 0, 0, 0 };
+    unsigned int value_count = key->value_count;
+    size_t size = sizeof(unsigned int) + key->len + 1, i;
+    freeze_value_t *value;
+
+    fwrite(&value_count, sizeof(value_count), 1, out);
+    fwrite(src_data + key->offset, 1, key->len + 1, out);
+    for (i = 0; i < key->value_count; ++i) {
+        value = &values[key->first + i];
+        fwrite(src_data + value->offset, 1, value->len + 1, out);
+        size += value->len + 1;
+    }
+    fwrite(padding, 1, ((size + 3) & ~(size_t)3) - size, out);
+}
+
+int main(int argc, const char **argv) {
+    filedict_t src;
+    filedict_frozen_header_t header;
+    freeze_key_t *keys = NULL;
+    freeze_value_t *values = NULL;
+    unsigned long long frozen_seed = 0;
+    size_t key_count, displacement_count, i, offset, *slot_keys;
+    unsigned int *displacements;
+    /* What goes in each slot: the record's offset, with part of its key's hash on top */
+    unsigned long long *slots;
+    const char *error = NULL;
+    char tmp_path[4096];
+    FILE *out;
+    int failed;
+
+    if (argc != 3) {
+        printf("Usage: ./freeze dict-file.fdict frozen-file.fdict\n");
+        printf("Writes a read-only copy of the dict for filedict_open_frozen, with one record per key.\n");
+        return 1;
+    }
+
+    filedict_init(&src);
+    filedict_open_readonly(&src, argv[1]);
+    error_check(src);
+
+    key_count = collect_keys(&src, &keys, &values, &frozen_seed, &error);
+    if (error) src.error = error;
+    error_check(src);
+
+    displacement_count = key_count / KEYS_PER_DISPLACEMENT + 1;
+    displacements = calloc(displacement_count, sizeof(unsigned int));
+    slot_keys = malloc((key_count ? key_count : 1) * sizeof(size_t));
+    slots = malloc((key_count ? key_count : 1) * sizeof(unsigned long long));
+
+    place_keys(keys, key_count, displacements, displacement_count, slot_keys);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = FILEDICT_FROZEN_MAGIC;
+    header.version = FILEDICT_FROZEN_VERSION;
+    header.hash_id = src.hash_id;
+    header.hash_seed = src.hash_seed;
+    header.frozen_seed = frozen_seed;
+    header.key_count = key_count;
+    header.displacement_count = displacement_count;
+    header.displacements_offset = sizeof(header);
+    header.slots_offset = (header.displacements_offset + displacement_count * sizeof(unsigned int) + 7) & ~7ULL;
+
+    /* Records go in slot order, so going through every key reads the file front to back */
+    offset = header.slots_offset + key_count * sizeof(unsigned long long);
+    for (i = 0; i < key_count; ++i) {
+        slots[i] = filedict_frozen_fingerprint(keys[slot_keys[i]].hash) << FILEDICT_FROZEN_OFFSET_BITS | offset;
+        offset += record_size(&keys[slot_keys[i]], values);
+    }
+    header.records_end = offset;
+    if (offset >> FILEDICT_FROZEN_OFFSET_BITS) src.error = "Too big to freeze";
+    error_check(src);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", argv[2]);
+    out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        printf("[%i] error: %s\n", __LINE__, strerror(errno));
+        filedict_deinit(&src);
+        return 2;
+    }
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(displacements, sizeof(unsigned int), displacement_count, out);
+    for (i = header.displacements_offset + displacement_count * sizeof(unsigned int); i < header.slots_offset; ++i) {
+        fputc(0, out);
+    }
+    fwrite(slots, sizeof(unsigned long long), key_count, out);
+    /* This goes through the source in slot order, but reads each value only once */
+    for (i = 0; i < key_count; ++i) {
+        write_record(&keys[slot_keys[i]], values, out);
+    }
+
+    failed = ferror(out);
+    if (fclose(out) != 0) failed = 1;
+    if (failed || rename(tmp_path, argv[2]) != 0) {
+        printf("[%i] error: %s\n", __LINE__, strerror(errno));
+        unlink(tmp_path);
+        filedict_deinit(&src);
+        return 2;
+    }
+
+    printf("keys:          %zu\n", key_count);
+    printf("displacements: %zu\n", displacement_count);
+    printf("file size:     %zu bytes (was %zu)\n", (size_t)header.records_end, src.data_len);
+
+    free(keys);
+    free(values);
+    free(displacements);
+    free(slot_keys);
+    free(slots);
+    filedict_deinit(&src);
+    return 0;
+}
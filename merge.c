@@ -1,38 +1,191 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "filedict.h"
 
 #define error_check(filedict) do { if (filedict.error) { printf("[%i] error: %s\n", __LINE__, filedict.error); filedict_deinit(&filedict); return 2; } } while (0)
 
+#define MAX_THREADS 256
+
+/*
+ * Each worker owns the destination buckets in [bucket_start, bucket_end). It reads every source,
+ * but only inserts the keys that land in its own buckets, so workers never touch the same chain
+ * and never wait on each other's bucket locks. Other processes writing to a dest with
+ * FILEDICT_FEATURE_MULTI_WRITER can touch any chain though, so workers still take
+ * filedict_lock_bucket around each insert, like filedict_insert does.
+ *
+ * What workers do share is the end of the file, and the key index if dest has one. Those are
+ * guarded by fcntl locks, which only keep threads apart when they're open file description locks.
+ * See have_ofd_locks.
+ */
+typedef struct merge_worker_t {
+    pthread_t thread;
+    const char *dest_path;
+    const char **src_paths;
+    size_t src_count;
+    size_t bucket_start;
+    size_t bucket_end;
+    int threaded;
+    const char *error;
+} merge_worker_t;
+
+static void *merge_worker(void *arg) {
+    merge_worker_t *worker = (merge_worker_t *)arg;
+    filedict_t dest, src;
+    filedict_scan_t scan;
+    size_t file_i, bucket_count, bucket_i, key_len, key_hash;
+    int success;
+
+    filedict_init(&dest);
+    filedict_open(&dest, worker->dest_path);
+    if (dest.error) { worker->error = dest.error; filedict_deinit(&dest); return NULL; }
+
+    /* We're not the only ones allocating at the end of dest anymore */
+    if (worker->threaded) dest.features |= FILEDICT_FEATURE_MULTI_WRITER;
+    bucket_count = ((filedict_header_t *)dest.data)->initial_bucket_count;
+
+    for (file_i = 0; file_i < worker->src_count && worker->error == NULL; ++file_i, filedict_deinit(&src)) {
+        filedict_init(&src);
+        filedict_open_readonly(&src, worker->src_paths[file_i]);
+        if (src.error) { worker->error = src.error; continue; }
+
+        scan = filedict_scan(&src);
+
+        success = 1;
+        while (success && scan.value) {
+            key_len = strlen(scan.key);
+            key_hash = dest.hash_function(scan.key, key_len, dest.hash_seed);
+
+            bucket_i = key_hash % bucket_count;
+            if (bucket_i >= worker->bucket_start && bucket_i < worker->bucket_end) {
+                filedict_refresh(&dest);
+                filedict_lock_bucket(&dest, bucket_i);
+                filedict_insert_hashed(
+                    &dest,
+                    scan.key,
+                    key_len,
+                    key_hash,
+                    scan.value,
+                    scan.value_len,
+                    1,
+                    NULL,
+                    NULL
+                );
+                filedict_unlock_bucket(&dest, bucket_i);
+                if (dest.error) { worker->error = dest.error; break; }
+            }
+            success = filedict_scan_next(&scan);
+        }
+        if (src.error && worker->error == NULL) worker->error = src.error;
+    }
+
+    filedict_deinit(&dest);
+    return NULL;
+}
+
+/*
+ * Whether fcntl locks on our own descriptors of fd's file keep our threads from each other. Classic
+ * POSIX locks belong to the whole process, so with only those, every thread would get every lock.
+ */
+static int have_ofd_locks(int fd) {
+#ifdef F_OFD_GETLK
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = FILEDICT_LOCK_GROWTH;
+    lock.l_len = 1;
+    return fcntl(fd, F_OFD_GETLK, &lock) == 0;
+#else
+    return 0;
+#endif
+}
+
 int main(int argc, const char **argv) {
-    size_t file_i;
-    int success = 1;
+    size_t file_i, thread_count = 1, src_bytes = 0, bucket_count, i, started;
+    int arg_i = 1;
     filedict_t dest, src;
-    filedict_read_t read;
+    merge_worker_t workers[MAX_THREADS];
 
-    if (argc < 2) {
-        printf("Usage: ./merge dest-file.fdict src-file.fdict ...\n");
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        thread_count = strtoul(argv[2], NULL, 10);
+        if (thread_count < 1) thread_count = 1;
+        if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+        arg_i = 3;
+    }
+
+    if (argc - arg_i < 1) {
+        printf("Usage: ./merge [-j threads] dest-file.fdict src-file.fdict ...\n");
+        printf("With -j, the destination's buckets are split between that many threads.\n");
         return 1;
     }
 
     filedict_init(&dest);
-    filedict_open(&dest, argv[1]);
+    filedict_open(&dest, argv[arg_i]);
     error_check(dest);
 
-    for (file_i = 2; file_i < argc; ++file_i, filedict_deinit(&src)) {
-        filedict_init(&src);
-        filedict_open_readonly(&src, argv[file_i]);
-        error_check(src);
+    bucket_count = ((filedict_header_t *)dest.data)->initial_bucket_count;
+    if (thread_count > bucket_count) thread_count = bucket_count;
+    if (thread_count > 1 && !have_ofd_locks(dest.fd)) {
+        printf("This system doesn't have open file description locks, so merging on one thread\n");
+        thread_count = 1;
+    }
 
-        read = filedict_get(&src, NULL);
+    /*
+     * With several workers, grow dest once up front so they rarely have to fight over the growth
+     * lock. How much each source grew past its initial buckets is a fair guess at how much it'll
+     * grow dest. The header and initial buckets themselves never get copied.
+     */
+    if (thread_count > 1) {
+        for (file_i = arg_i + 1; file_i < argc; ++file_i, filedict_deinit(&src)) {
+            filedict_header_t *src_header;
 
-        success = 1;
-        while (success && read.value) {
-            filedict_insert_unique(&dest, read.entry->bytes, read.value);
-            success = filedict_get_next(&read);
+            filedict_init(&src);
+            filedict_open_readonly(&src, argv[file_i]);
+            error_check(src);
+            src_header = (filedict_header_t *)src.data;
+            src_bytes += src_header->data_end - filedict_file_size(src_header->initial_bucket_count);
         }
-        error_check(src);
+        filedict_reserve(&dest, src_bytes);
         error_check(dest);
     }
+
+    for (i = 0; i < thread_count; ++i) {
+        workers[i].dest_path = argv[arg_i];
+        workers[i].src_paths = &argv[arg_i + 1];
+        workers[i].src_count = argc - arg_i - 1;
+        workers[i].bucket_start = bucket_count * i / thread_count;
+        workers[i].bucket_end = bucket_count * (i + 1) / thread_count;
+        workers[i].threaded = thread_count > 1;
+        workers[i].error = NULL;
+    }
+
+    if (thread_count == 1) {
+        merge_worker(&workers[0]);
+    }
+    else {
+        for (started = 0; started < thread_count; ++started) {
+            if (pthread_create(&workers[started].thread, NULL, merge_worker, &workers[started]) != 0) {
+                /* Do the rest on this thread */
+                workers[started].bucket_end = bucket_count;
+                merge_worker(&workers[started]);
+                thread_count = started + 1;
+                break;
+            }
+        }
+        for (i = 0; i < started; ++i) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    for (i = 0; i < thread_count; ++i) {
+        if (workers[i].error) dest.error = workers[i].error;
+    }
+    error_check(dest);
+
+    filedict_deinit(&dest);
+    return 0;
 }
@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "filedict.hpp"
+
+int main() {
+    int count;
+
+    try {
+        printf("-------- opening and inserting from C++ ---------\n");
+        filedict::dict dict("test-hpp.data", filedict::open_mode::truncate, filedict::options{64});
+        std::string key = "cpp-key", value = "cpp-value";
+        std::string_view long_key = "cpp-key-and-more";
+
+        dict.insert(key, value);
+        dict.insert(key, "second");
+        /* Only the first 7 bytes, which isn't NUL-terminated where it ends */
+        dict.insert(long_key.substr(0, 7), "third");
+        dict.insert_unique(key, "second");
+
+        printf("-------- values as string_views ---------\n");
+        const char *expected[] = { "cpp-value", "second", "third" };
+        count = 0;
+        for (std::string_view found : dict.get("cpp-key")) {
+            if (count >= 3 || found != expected[count]) {
+                printf("Value %i was %.*s\n", count, (int)found.size(), found.data());
+                return 1;
+            }
+            count += 1;
+        }
+        if (count != 3) {
+            printf("Expected 3 values, got %i\n", count);
+            return 1;
+        }
+        if (dict.contains("cpp-key-and-more") || dict.contains(std::string_view())) {
+            printf("Found a key that was never inserted\n");
+            return 1;
+        }
+
+        printf("-------- every item, after moving the handle ---------\n");
+        for (int i = 0; i < 100; ++i) dict.insert("many-" + std::to_string(i), std::to_string(i));
+        filedict::dict moved = std::move(dict);
+        count = 0;
+        for (auto item : moved.items()) {
+            if (item.key.size() != strlen(item.key.data()) || item.value.size() != strlen(item.value.data())) {
+                printf("Item %.*s has the wrong length\n", (int)item.key.size(), item.key.data());
+                return 1;
+            }
+            count += 1;
+        }
+        if (count != 103) {
+            printf("Expected 103 items, got %i\n", count);
+            return 1;
+        }
+        if (moved.remove("cpp-key", "second") != 1 || moved.remove("cpp-key") != 2 || moved.contains("cpp-key")) {
+            printf("Removing didn't work\n");
+            return 1;
+        }
+        moved.commit();
+
+        printf("-------- keys and values with NUL bytes ---------\n");
+        std::string_view with_nul("many-1\0x", 8);
+        int thrown = 0;
+        try { moved.insert(with_nul, "value"); } catch (const filedict::error &) { thrown += 1; }
+        try { moved.insert("nul", with_nul); } catch (const filedict::error &) { thrown += 1; }
+        try { moved.insert_unique("nul", with_nul); } catch (const filedict::error &) { thrown += 1; }
+        try { moved.get(with_nul); } catch (const filedict::error &) { thrown += 1; }
+        try { moved.remove(with_nul); } catch (const filedict::error &) { thrown += 1; }
+        if (thrown != 5) {
+            printf("Only %i of 5 calls with NUL bytes threw\n", thrown);
+            return 1;
+        }
+        if (moved.contains("nul") || !moved.contains("many-1")) {
+            printf("A key with a NUL byte changed the file\n");
+            return 1;
+        }
+
+        printf("-------- item lengths in length-prefixed files ---------\n");
+        filedict::options prefixed{64, FILEDICT_FEATURE_LENGTH_PREFIXED};
+        filedict::dict lengths("test-hpp2.data", filedict::open_mode::truncate, prefixed);
+        std::string big(1000, 'b');
+        lengths.insert("short", "s");
+        lengths.insert("short", "");
+        lengths.insert("big", big);
+        count = 0;
+        for (auto item : lengths.items()) {
+            if (item.value.size() != strlen(item.value.data())) {
+                printf("Item %.*s has the wrong length\n", (int)item.key.size(), item.key.data());
+                return 1;
+            }
+            count += 1;
+        }
+        if (count != 3) {
+            printf("Expected 3 items, got %i\n", count);
+            return 1;
+        }
+
+        printf("-------- errors as exceptions ---------\n");
+        try {
+            filedict::basic_dict<FILEDICT_BUCKET_ENTRY_BYTES, FILEDICT_BUCKET_ENTRY_COUNT, filedict::djb2_hash> other(
+                "test-hpp.data",
+                filedict::open_mode::read_only
+            );
+            printf("Opened a file with the wrong hash function\n");
+            return 1;
+        }
+        catch (const filedict::error &) {
+        }
+        try {
+            filedict::dict missing("does-not-exist/test.data", filedict::open_mode::read_only);
+            printf("Opened a file that doesn't exist\n");
+            return 1;
+        }
+        catch (const filedict::error &) {
+        }
+    }
+    catch (const filedict::error &e) {
+        printf("error: %s\n", e.what());
+        return 1;
+    }
+
+    printf("\nEverything went well?\n");
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 
 #include "filedict.h"
 
@@ -13,7 +14,16 @@ int main() {
     filedict_t filedict, filedict2;
     filedict_init(&filedict);
     filedict_init(&filedict2);
-    int status;
+    int status, i, scanned, scanned_in_parts;
+    filedict_scan_t scan;
+    filedict_frozen_read_t frozen_read;
+    filedict_prefix_scan_t prefix_scan;
+    const char *last_key;
+    const char *many_keys[300];
+    filedict_read_t many_reads[300];
+    filedict_changes_t changes;
+    char key[64], value[64], big_value[4000], batch_strings[600][64];
+    filedict_batch_item_t batch[600];
     error_check();
     error_check2();
 
@@ -91,6 +101,874 @@ int main() {
     status = system("./merge test.data test2.data");
     printf("merge exited with status code %i\n", status);
 
+    printf("-------- overflowing the buckets of a small dict ---------\n");
+    filedict_init(&filedict);
+    filedict_open_f(&filedict, "test3.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        snprintf(value, sizeof(value), "value of %i", i);
+        filedict_insert(&filedict, key, value);
+        error_check();
+    }
+    printf("overflow bucket count: %llu\n", ((filedict_header_t *)filedict.data)->overflow_bucket_count);
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        snprintf(value, sizeof(value), "value of %i", i);
+        read = filedict_get(&filedict, key);
+        if (read.value == NULL || strcmp(read.value, value) != 0) {
+            printf("Lookup of %s failed\n", key);
+            return 1;
+        }
+    }
+    read = filedict_get(&filedict, "not-a-key");
+    if (read.value != NULL) {
+        printf("Lookup of a missing key found %s\n", read.value);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- running `compact test3.data` ---------\n");
+    status = system("./compact test3.data");
+    printf("compact exited with status code %i\n", status);
+
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test3.data");
+    error_check();
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        snprintf(value, sizeof(value), "value of %i", i);
+        read = filedict_get(&filedict, key);
+        if (read.value == NULL || strcmp(read.value, value) != 0) {
+            printf("Lookup of %s failed after compacting\n", key);
+            return 1;
+        }
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- storing a value bigger than an entry ---------\n");
+    filedict_init(&filedict);
+    filedict_open_new(&filedict, "test5.data");
+    error_check();
+    memset(big_value, 'x', sizeof(big_value) - 1);
+    big_value[sizeof(big_value) - 1] = 0;
+    filedict_insert(&filedict, "big", "small before");
+    filedict_insert(&filedict, "big", big_value);
+    filedict_insert(&filedict, "big", "small after");
+    filedict_insert_unique(&filedict, "big", big_value);
+    error_check();
+    read = filedict_get(&filedict, "big");
+    success = filedict_get_next(&read);
+    if (!success || strcmp(read.value, big_value) != 0) {
+        printf("Big value didn't round trip\n");
+        return 1;
+    }
+    printf("Read %zu byte value\n", strlen(read.value));
+    if (!filedict_get_next(&read) || filedict_get_next(&read)) {
+        printf("Expected exactly one value after the big one\n");
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- inserting a batch ---------\n");
+    filedict_init(&filedict);
+    filedict_open_f(&filedict, "test6.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    for (i = 0; i < 600; ++i) {
+        snprintf(batch_strings[i], sizeof(batch_strings[i]), "batch-key-%i", i % 60);
+        snprintf(batch_strings[i] + 32, sizeof(batch_strings[i]) - 32, "batch value %i", i / 60);
+        batch[i].key = batch_strings[i];
+        batch[i].value = batch_strings[i] + 32;
+    }
+    filedict_insert_batch(&filedict, batch, 600);
+    error_check();
+    for (i = 0; i < 60; ++i) {
+        int value_i = 0;
+
+        snprintf(key, sizeof(key), "batch-key-%i", i);
+        read = filedict_get(&filedict, key);
+        for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+            snprintf(value, sizeof(value), "batch value %i", value_i++);
+            if (strcmp(read.value, value) != 0) break;
+        }
+        if (value_i != 10 || success) {
+            printf("Batch values of %s came back wrong\n", key);
+            return 1;
+        }
+    }
+    printf("overflow bucket count: %llu\n", ((filedict_header_t *)filedict.data)->overflow_bucket_count);
+    filedict_deinit(&filedict);
+
+    printf("-------- inserting a batch with an empty value ---------\n");
+    filedict_init(&filedict);
+    filedict_open_f(&filedict, "test18.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    batch[0].key = "batch-empty";
+    batch[0].value = "a";
+    batch[1].key = "batch-empty";
+    batch[1].value = "";
+    batch[2].key = "batch-empty";
+    batch[2].value = "b";
+    filedict_insert_batch(&filedict, batch, 3);
+    error_check();
+    read = filedict_get(&filedict, "batch-empty");
+    if (read.value == NULL || strcmp(read.value, "a") != 0 ||
+        !filedict_get_next(&read) || strcmp(read.value, "b") != 0 || filedict_get_next(&read)) {
+        printf("An empty value in a batch hid the values after it\n");
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- reading a djb2 dict without asking for djb2 ---------\n");
+    filedict_init(&filedict);
+    filedict.hash_id = FILEDICT_HASH_DJB2;
+    filedict_open_new(&filedict, "test4.data");
+    error_check();
+    filedict_insert(&filedict, "hashed with", "djb2");
+    filedict_deinit(&filedict);
+
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test4.data");
+    error_check();
+    read = filedict_get(&filedict, "hashed with");
+    if (filedict.hash_id != FILEDICT_HASH_DJB2 || read.value == NULL) {
+        printf("Hash ID wasn't picked up from the header\n");
+        return 1;
+    }
+    printf("Read %s\n", read.value);
+    filedict_deinit(&filedict);
+
+#ifdef FILEDICT_STATS
+    printf("-------- counting what lookups do ---------\n");
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test3.data");
+    error_check();
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        read = filedict_get(&filedict, key);
+    }
+    read = filedict_get(&filedict, "not-a-key");
+    if (filedict.stats.gets != 201 || filedict.stats.get_misses != 1) {
+        printf("Expected 201 gets and 1 miss, counted %llu and %llu\n", filedict.stats.gets, filedict.stats.get_misses);
+        return 1;
+    }
+    filedict_stats_dump(&filedict, stdout);
+    filedict_deinit(&filedict);
+
+#endif
+
+    printf("-------- removing keys and values ---------\n");
+    filedict_init(&filedict);
+    filedict_open_f(&filedict, "test10.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    for (i = 0; i < 100; ++i) {
+        snprintf(key, sizeof(key), "removable-%i", i);
+        filedict_insert(&filedict, key, "a");
+        filedict_insert(&filedict, key, big_value);
+        filedict_insert(&filedict, key, "c");
+    }
+    error_check();
+    if (filedict_remove_value(&filedict, "removable-1", big_value) != 1) {
+        printf("Couldn't remove a heap value\n");
+        return 1;
+    }
+    read = filedict_get(&filedict, "removable-1");
+    if (read.value == NULL || strcmp(read.value, "a") != 0 || !filedict_get_next(&read) || strcmp(read.value, "c") != 0 || filedict_get_next(&read)) {
+        printf("Wrong values left after removing one\n");
+        return 1;
+    }
+    filedict_remove_value(&filedict, "removable-1", "a");
+    filedict_remove_value(&filedict, "removable-1", "c");
+    if (filedict_get(&filedict, "removable-1").value != NULL) {
+        printf("Key is still there after removing all of its values\n");
+        return 1;
+    }
+    if (filedict_remove(&filedict, "removable-2") != 3 || filedict_get(&filedict, "removable-2").value != NULL) {
+        printf("Couldn't remove a key\n");
+        return 1;
+    }
+    /* removable-5 and removable-50 through removable-59 */
+    if (filedict_remove_if(&filedict, filedict_key_has_prefix, "removable-5") != 33) {
+        printf("Removing by prefix removed the wrong number of values\n");
+        return 1;
+    }
+    filedict_insert(&filedict, "removable-2", "again");
+    filedict_insert(&filedict, "removable-55", "again");
+    error_check();
+    for (i = 0; i < 100; ++i) {
+        int value_count = 0, expected = 3;
+
+        if (i == 1 || i == 5 || i / 10 == 5) expected = 0;
+        if (i == 2 || i == 55) expected = 1;
+
+        snprintf(key, sizeof(key), "removable-%i", i);
+        read = filedict_get(&filedict, key);
+        for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+            value_count += 1;
+        }
+        if (value_count != expected) {
+            printf("%s has %i values instead of %i\n", key, value_count, expected);
+            return 1;
+        }
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- length-prefixed values ---------\n");
+    filedict_init(&filedict);
+    filedict.features = FILEDICT_FEATURE_LENGTH_PREFIXED;
+    filedict_open_f(&filedict, "test11.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    for (i = 0; i < 100; ++i) {
+        snprintf(value, sizeof(value), "value %i%s", i, i % 3 ? "" : "!");
+        filedict_insert_unique(&filedict, "prefixed", value);
+        filedict_insert_unique(&filedict, "prefixed", value);
+    }
+    filedict_insert(&filedict, "prefixed", big_value);
+    filedict_insert(&filedict, "prefixed", "");
+    if (filedict_remove_value(&filedict, "prefixed", "value 50") != 1) {
+        printf("Couldn't remove a length-prefixed value\n");
+        return 1;
+    }
+    /* The entry that held "value 50" has room now, but this is still a duplicate */
+    filedict_insert_unique(&filedict, "prefixed", "value 95");
+    error_check();
+    filedict_deinit(&filedict);
+
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test11.data");
+    error_check();
+    if (!filedict_length_prefixed(&filedict)) {
+        printf("Length-prefixed feature wasn't picked up from the header\n");
+        return 1;
+    }
+    i = 0;
+    read = filedict_get(&filedict, "prefixed");
+    for (success = read.value != NULL; success; success = filedict_get_next(&read), ++i) {
+        if (i == 50) ++i;
+        if (i < 100) snprintf(value, sizeof(value), "value %i%s", i, i % 3 ? "" : "!");
+        if (strcmp(read.value, i < 100 ? value : i == 100 ? big_value : "") != 0) {
+            printf("Length-prefixed value %i came back as %s\n", i, read.value);
+            return 1;
+        }
+    }
+    scanned = 0;
+    for (scan = filedict_scan(&filedict); scan.value; filedict_scan_next(&scan)) {
+        scanned += 1;
+    }
+    error_check();
+    if (i != 102 || scanned != 101) {
+        printf("Read %i and scanned %i length-prefixed values instead of 101\n", i - 1, scanned);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- skipping chains with chain filters ---------\n");
+    filedict_init(&filedict);
+    filedict.features = FILEDICT_FEATURE_CHAIN_FILTER;
+    filedict_open_f(&filedict, "test12.data", O_CREAT | O_TRUNC | O_RDWR, 64);
+    error_check();
+    for (i = 0; i < 400; ++i) {
+        snprintf(key, sizeof(key), "filtered-%i", i);
+        filedict_insert(&filedict, key, "present");
+    }
+    error_check();
+    if (filedict_remove(&filedict, "filtered-399") != 1 || filedict_remove(&filedict, "not-there") != 0) {
+        printf("Removing from a file with chain filters removed the wrong number of values\n");
+        return 1;
+    }
+#ifdef FILEDICT_STATS
+    filedict_stats_reset(&filedict);
+#endif
+    for (i = 0; i < 1000; ++i) {
+        snprintf(key, sizeof(key), "absent-%i", i);
+        read = filedict_get(&filedict, key);
+        if (read.value != NULL) {
+            printf("Lookup of a missing key found %s\n", read.value);
+            return 1;
+        }
+    }
+#ifdef FILEDICT_STATS
+    printf("chain filter skips: %llu of 1000 misses\n", filedict.stats.chain_filter_skips);
+    if (filedict.stats.chain_filter_skips == 0) {
+        printf("Chain filters didn't skip anything\n");
+        return 1;
+    }
+#endif
+    filedict_deinit(&filedict);
+
+    status = system("./compact test12.data > /dev/null");
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test12.data");
+    error_check();
+    if (status != 0 || ((filedict_header_t *)filedict.data)->chain_filter_offset == 0) {
+        printf("Compacting lost the chain filters\n");
+        return 1;
+    }
+    for (i = 0; i < 399; ++i) {
+        snprintf(key, sizeof(key), "filtered-%i", i);
+        read = filedict_get(&filedict, key);
+        if (read.value == NULL) {
+            printf("Chain filter hid %s\n", key);
+            return 1;
+        }
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- compacting a file with a dangling heap reference ---------\n");
+    filedict_init(&filedict);
+    filedict_open_f(&filedict, "test17.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    filedict_insert(&filedict, "dangling", big_value);
+    read = filedict_get(&filedict, "dangling");
+    if (read.value == NULL || !filedict_is_heap_ref(read.value_slot)) {
+        printf("Expected a heap value\n");
+        return 1;
+    }
+    filedict_encode_heap_ref((char *)read.value_slot, (size_t)1 << 40);
+    filedict_deinit(&filedict);
+    /* It should give up with an error, not crash */
+    status = system("./compact test17.data > /dev/null");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 2) {
+        printf("Compacting a file with a dangling heap reference exited with %i\n", status);
+        return 1;
+    }
+
+    printf("-------- freezing test3.data and test11.data ---------\n");
+    status = system("./freeze test3.data test3.frozen && ./freeze test11.data test11.frozen");
+    printf("freeze exited with status code %i\n", status);
+    filedict_init(&filedict);
+    filedict_open_frozen(&filedict, "test3.frozen");
+    error_check();
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        snprintf(value, sizeof(value), "value of %i", i);
+        frozen_read = filedict_frozen_get(&filedict, key);
+        if (frozen_read.value == NULL || strcmp(frozen_read.value, value) != 0 || filedict_frozen_get_next(&frozen_read)) {
+            printf("Frozen lookup of %s failed\n", key);
+            return 1;
+        }
+    }
+    for (i = 0; i < 1000; ++i) {
+        snprintf(key, sizeof(key), "absent-%i", i);
+        frozen_read = filedict_frozen_get(&filedict, key);
+        if (frozen_read.value != NULL) {
+            printf("Frozen lookup of a missing key found %s\n", frozen_read.value);
+            return 1;
+        }
+    }
+    scanned = 0;
+    for (frozen_read = filedict_frozen_get(&filedict, NULL); frozen_read.value; filedict_frozen_get_next(&frozen_read)) {
+        scanned += 1;
+    }
+    if (scanned != 200) {
+        printf("Went through %i frozen values instead of 200\n", scanned);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    filedict_init(&filedict);
+    filedict_open_frozen(&filedict, "test11.frozen");
+    error_check();
+    filedict_init(&filedict2);
+    filedict_open_readonly(&filedict2, "test11.data");
+    error_check2();
+    read = filedict_get(&filedict2, "prefixed");
+    frozen_read = filedict_frozen_get(&filedict, "prefixed");
+    for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+        if (frozen_read.value == NULL || strcmp(frozen_read.value, read.value) != 0) {
+            printf("Frozen value %s should have been %s\n", frozen_read.value, read.value);
+            return 1;
+        }
+        filedict_frozen_get_next(&frozen_read);
+    }
+    if (frozen_read.value != NULL) {
+        printf("Frozen key has more values than the original\n");
+        return 1;
+    }
+    filedict_deinit(&filedict2);
+    filedict_deinit(&filedict);
+
+    printf("-------- freezing keys whose hashes collide ---------\n");
+    filedict_init(&filedict);
+    filedict.hash_id = FILEDICT_HASH_DJB2;
+    filedict_open_f(&filedict, "test19.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    filedict_insert(&filedict, "AB", "first");
+    filedict_insert(&filedict, "B!", "second");
+    error_check();
+    if (filedict_hash(&filedict, "AB") != filedict_hash(&filedict, "B!")) {
+        printf("Expected AB and B! to have the same djb2 hash\n");
+        return 1;
+    }
+    filedict_deinit(&filedict);
+    status = system("./freeze test19.data test19.frozen > /dev/null");
+    filedict_init(&filedict);
+    filedict_open_frozen(&filedict, "test19.frozen");
+    error_check();
+    frozen_read = filedict_frozen_get(&filedict, "AB");
+    if (status != 0 || frozen_read.value == NULL || strcmp(frozen_read.value, "first") != 0) {
+        printf("Couldn't freeze keys with the same hash\n");
+        return 1;
+    }
+    frozen_read = filedict_frozen_get(&filedict, "B!");
+    if (frozen_read.value == NULL || strcmp(frozen_read.value, "second") != 0) {
+        printf("Frozen lookup of B! found %s\n", frozen_read.value);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- prefix scans with a key index ---------\n");
+    filedict_init(&filedict);
+    filedict.features = FILEDICT_FEATURE_KEY_INDEX;
+    filedict_open_f(&filedict, "test13.data", O_CREAT | O_TRUNC | O_RDWR, 64);
+    error_check();
+    /* Enough keys to fill the key log a few times */
+    for (i = 0; i < 700; ++i) {
+        snprintf(key, sizeof(key), "Foo::Bar%i", i);
+        filedict_insert(&filedict, key, "first");
+        filedict_insert(&filedict, key, "second");
+        snprintf(key, sizeof(key), "Foo::Baz%i", i);
+        filedict_insert(&filedict, key, "only");
+        snprintf(key, sizeof(key), "Other%i", i);
+        filedict_insert(&filedict, key, "other");
+    }
+    error_check();
+    filedict_remove(&filedict, "Foo::Bar5");
+    filedict_remove(&filedict, "Foo::Baz5");
+    filedict_insert(&filedict, "Foo::Baz5", "again");
+    error_check();
+
+    scanned = 0;
+    scanned_in_parts = 0;
+    last_key = NULL;
+    for (prefix_scan = filedict_prefix_scan(&filedict, "Foo::Ba"); prefix_scan.value; filedict_prefix_scan_next(&prefix_scan)) {
+        if (strncmp(prefix_scan.key, "Foo::Ba", 7) != 0) {
+            printf("Prefix scan found %s\n", prefix_scan.key);
+            return 1;
+        }
+        if (prefix_scan.key != last_key) {
+            /* Keys from the index come in order, and only those from the log come after */
+            if (last_key != NULL && prefix_scan.log_i == 0 && strcmp(last_key, prefix_scan.key) >= 0) {
+                printf("Prefix scan found %s after %s\n", prefix_scan.key, last_key);
+                return 1;
+            }
+            scanned_in_parts += 1;
+            last_key = prefix_scan.key;
+        }
+        scanned += 1;
+    }
+    error_check();
+    if (scanned != 699 * 2 + 700 || scanned_in_parts != 699 + 700) {
+        printf("Prefix scan found %i values in %i keys instead of 2098 in 1399\n", scanned, scanned_in_parts);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    status = system("./compact test13.data > /dev/null");
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test13.data");
+    error_check();
+    scanned = 0;
+    for (prefix_scan = filedict_prefix_scan(&filedict, "Foo::Bar5"); prefix_scan.value; filedict_prefix_scan_next(&prefix_scan)) {
+        scanned += 1;
+    }
+    if (status != 0 || ((filedict_header_t *)filedict.data)->key_index_offset == 0 || scanned != 110 * 2) {
+        printf("Prefix scan after compacting found %i values instead of 220\n", scanned);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    /* Files without a key index get scanned whole */
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test3.data");
+    error_check();
+    scanned = 0;
+    for (prefix_scan = filedict_prefix_scan(&filedict, "many-keys-1"); prefix_scan.value; filedict_prefix_scan_next(&prefix_scan)) {
+        scanned += 1;
+    }
+    if (scanned != 111) {
+        printf("Prefix scan without a key index found %i values instead of 111\n", scanned);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- opening with map options ---------\n");
+    filedict_init(&filedict);
+    filedict.map_options = FILEDICT_MAP_POPULATE | FILEDICT_MAP_RANDOM | FILEDICT_MAP_HUGEPAGE | FILEDICT_MAP_LOCK_BUCKETS;
+    filedict_open_readonly(&filedict, "test3.data");
+    error_check();
+    filedict_warm(&filedict, 0.5);
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        read = filedict_get(&filedict, key);
+        if (read.value == NULL) {
+            printf("Couldn't find %s with map options\n", key);
+            return 1;
+        }
+    }
+    filedict_deinit(&filedict);
+
+    filedict_init(&filedict);
+    filedict.map_options = FILEDICT_MAP_WILLNEED | FILEDICT_MAP_LOCK_BUCKETS;
+    filedict_open_frozen(&filedict, "test3.frozen");
+    error_check();
+    frozen_read = filedict_frozen_get(&filedict, "many-keys-7");
+    if (frozen_read.value == NULL || strcmp(frozen_read.value, "value of 7") != 0) {
+        printf("Frozen lookup with map options failed\n");
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- looking up many keys at once ---------\n");
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test3.data");
+    error_check();
+    /* Every other key is missing */
+    for (i = 0; i < 300; ++i) {
+        snprintf(batch_strings[i], sizeof(batch_strings[i]), i % 2 ? "absent-%i" : "many-keys-%i", i / 2);
+        many_keys[i] = batch_strings[i];
+    }
+    filedict_get_many(&filedict, many_keys, 300, many_reads);
+    for (i = 0; i < 300; ++i) {
+        read = filedict_get(&filedict, many_keys[i]);
+        if ((read.value == NULL) != (many_reads[i].value == NULL) || (read.value && strcmp(read.value, many_reads[i].value) != 0)) {
+            printf("filedict_get_many and filedict_get disagree about %s\n", many_keys[i]);
+            return 1;
+        }
+        if (many_reads[i].value != NULL && filedict_get_next(&many_reads[i])) {
+            printf("filedict_get_many found a second value for %s\n", many_keys[i]);
+            return 1;
+        }
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- keys and values with lengths ---------\n");
+    /* Slices of one buffer, so nothing ends in a NUL byte */
+    strcpy(value, "alphabetagamma");
+    big_value[sizeof(big_value) - 3] = 'y';
+    big_value[sizeof(big_value) - 2] = 'z';
+    for (i = 0; i < 2; ++i) {
+        filedict_init(&filedict);
+        filedict.features = i ? FILEDICT_FEATURE_LENGTH_PREFIXED : 0;
+        filedict_open_f(&filedict, "test14.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+        error_check();
+        filedict_insert_n(&filedict, value, 5, value + 5, 4);
+        filedict_insert_n(&filedict, value, 5, value + 9, 5);
+        filedict_insert_unique_n(&filedict, value, 5, value + 5, 4);
+        filedict_insert_unique_n(&filedict, value, 5, value + 5, 3);
+        filedict_insert_n(&filedict, value, 4, big_value, sizeof(big_value) - 2);
+        filedict_insert_unique_n(&filedict, value, 4, big_value, sizeof(big_value) - 2);
+        error_check();
+
+        read = filedict_get_n(&filedict, value, 5);
+        if (read.value == NULL || read.value_len != 4 || strcmp(read.value, "beta") != 0 ||
+            !filedict_get_next(&read) || read.value_len != 5 || strcmp(read.value, "gamma") != 0 ||
+            !filedict_get_next(&read) || read.value_len != 3 || strcmp(read.value, "bet") != 0 ||
+            filedict_get_next(&read)) {
+            printf("Values inserted with lengths didn't round trip\n");
+            return 1;
+        }
+        read = filedict_get(&filedict, "alph");
+        if (read.value == NULL || read.value_len != sizeof(big_value) - 2 || read.value[read.value_len - 1] != 'y' || read.value[read.value_len] != 0 || filedict_get_next(&read)) {
+            printf("Big value inserted with its length didn't round trip\n");
+            return 1;
+        }
+        if (filedict_get_n(&filedict, value, 3).value != NULL) {
+            printf("Found a key that's only a prefix of one that's there\n");
+            return 1;
+        }
+        /* Stored as is, this key would end at its NUL byte, and the value would be split in two */
+        memcpy(key, "alpha\0beta", 11);
+        if (filedict_get_n(&filedict, key, 10).value != NULL) {
+            printf("A key with a NUL byte matched a key and its value\n");
+            return 1;
+        }
+        filedict_insert_n(&filedict, key, 10, "value", 5);
+        if (filedict.error == NULL) {
+            printf("Inserted a key with a NUL byte\n");
+            return 1;
+        }
+        filedict.error = NULL;
+        filedict_insert_n(&filedict, "nul", 3, key, 10);
+        if (filedict.error == NULL || filedict_get(&filedict, "nul").value != NULL) {
+            printf("Inserted a value with a NUL byte\n");
+            return 1;
+        }
+        filedict.error = NULL;
+        filedict_deinit(&filedict);
+    }
+    big_value[sizeof(big_value) - 3] = 'x';
+    big_value[sizeof(big_value) - 2] = 'x';
+
+    printf("-------- committing only what changed ---------\n");
+    filedict_init(&filedict);
+    filedict.durability = FILEDICT_DURABILITY_COMMIT;
+    filedict_open_f(&filedict, "test15.data", O_CREAT | O_TRUNC | O_RDWR, 1024);
+    error_check();
+    filedict_commit(&filedict);
+    error_check();
+    filedict_insert(&filedict, "durable", "value");
+    filedict_insert(&filedict, "durable", big_value);
+    if (filedict.dirty_count == 0) {
+        printf("Inserting didn't mark anything to commit\n");
+        return 1;
+    }
+    filedict_commit(&filedict);
+    error_check();
+    if (filedict.dirty_count != 0) {
+        printf("Committing left %zu ranges to commit\n", filedict.dirty_count);
+        return 1;
+    }
+    /* More scattered writes than ranges we keep track of */
+    for (i = 0; i < 500; ++i) {
+        snprintf(key, sizeof(key), "durable-%i", i);
+        filedict_insert(&filedict, key, "value");
+    }
+    filedict_remove(&filedict, "durable");
+    if (filedict.dirty_count == 0 || filedict.dirty_count > FILEDICT_DIRTY_RANGES) {
+        printf("Expected between 1 and %i ranges to commit, not %zu\n", FILEDICT_DIRTY_RANGES, filedict.dirty_count);
+        return 1;
+    }
+    filedict_commit(&filedict);
+    error_check();
+    filedict.durability = FILEDICT_DURABILITY_PERIODIC;
+    filedict.last_sync_ms = 0;
+    filedict_insert(&filedict, "periodic", "value");
+    error_check();
+    if (filedict.dirty_count != 0) {
+        printf("Periodic durability didn't start writing back\n");
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- catching up on changes ---------\n");
+    filedict_init(&filedict);
+    filedict.features = FILEDICT_FEATURE_CHANGE_LOG;
+    filedict_open_f(&filedict, "test16.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    for (i = 0; i < 300; ++i) {
+        snprintf(key, sizeof(key), "change-%i", i % 100);
+        snprintf(value, sizeof(value), "value %i", i);
+        filedict_insert(&filedict, key, value);
+    }
+    filedict_remove(&filedict, "change-7");
+    error_check();
+    scanned = 0;
+    for (changes = filedict_changes_since(&filedict, 0); changes.value; filedict_changes_next(&changes)) {
+        snprintf(key, sizeof(key), "change-%llu", (changes.seq - 1) % 100);
+        snprintf(value, sizeof(value), "value %llu", changes.seq - 1);
+        if (strcmp(changes.key, key) != 0 || strcmp(changes.value, value) != 0) {
+            printf("Change %llu was %s => %s\n", changes.seq, changes.key, changes.value);
+            return 1;
+        }
+        scanned += 1;
+    }
+    error_check();
+    if (scanned != 297 || changes.seq != 300 || changes.lost || filedict_change_seq(&filedict) != 300) {
+        printf("Expected 297 changes up to 300, got %i up to %llu\n", scanned, changes.seq);
+        return 1;
+    }
+    filedict_insert(&filedict, "change-new", "newest");
+    changes = filedict_changes_since(&filedict, changes.seq);
+    if (changes.value == NULL || strcmp(changes.key, "change-new") != 0 || filedict_changes_next(&changes)) {
+        printf("Didn't pick up the one new change\n");
+        return 1;
+    }
+    changes = filedict_changes_since(&filedict, 1000);
+    if (!changes.lost || changes.value == NULL || strcmp(changes.key, "change-0") != 0) {
+        printf("Didn't start over from a change the file never got to\n");
+        return 1;
+    }
+    /* More than the log holds, so the oldest ones we haven't seen get overwritten */
+    for (i = 0; i < FILEDICT_CHANGE_LOG_RECORDS; ++i) {
+        snprintf(key, sizeof(key), "overwrite-%i", i);
+        filedict_insert(&filedict, key, "value");
+    }
+    error_check();
+    scanned = 0;
+    for (changes = filedict_changes_since(&filedict, 300); changes.value; filedict_changes_next(&changes)) {
+        scanned += 1;
+    }
+    if (!changes.lost || scanned != FILEDICT_CHANGE_LOG_RECORDS || changes.seq != 301 + FILEDICT_CHANGE_LOG_RECORDS) {
+        printf("Overwritten changes: lost %i, got %i up to %llu\n", changes.lost, scanned, changes.seq);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test15.data");
+    error_check();
+    changes = filedict_changes_since(&filedict, 0);
+    if (changes.value != NULL || filedict_change_seq(&filedict) != 0) {
+        printf("Found changes in a file without a change log\n");
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- scanning in file order, whole and in parts ---------\n");
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test6.data");
+    error_check();
+    scanned = 0;
+    for (scan = filedict_scan(&filedict); scan.value; filedict_scan_next(&scan)) {
+        if (strncmp(scan.key, "batch-key-", 10) != 0 || strncmp(scan.value, "batch value ", 12) != 0) {
+            printf("Scan came across %s => %s\n", scan.key, scan.value);
+            return 1;
+        }
+        scanned += 1;
+    }
+    scanned_in_parts = 0;
+    for (i = 0; i < 3; ++i) {
+        for (scan = filedict_scan_range(&filedict, i, 3); scan.value; filedict_scan_next(&scan)) {
+            scanned_in_parts += 1;
+        }
+    }
+    error_check();
+    if (scanned != 600 || scanned_in_parts != 600) {
+        printf("Scanned %i values, and %i in parts, instead of 600\n", scanned, scanned_in_parts);
+        return 1;
+    }
+    filedict_deinit(&filedict);
+
+    printf("-------- refreshing a reader after the file grows ---------\n");
+    filedict_init(&filedict);
+    filedict_open_f(&filedict, "test8.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    filedict_init(&filedict2);
+    filedict_open_readonly(&filedict2, "test8.data");
+    error_check2();
+    if (filedict_refresh(&filedict2) != 0) {
+        printf("Reader remapped although nothing changed\n");
+        return 1;
+    }
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "growing-key-%i", i);
+        filedict_insert(&filedict, key, "grew");
+    }
+    error_check();
+    if (filedict_refresh(&filedict2) != 1 || filedict_refresh(&filedict2) != 0) {
+        printf("Reader didn't remap exactly once after the file grew\n");
+        return 1;
+    }
+    error_check2();
+    read = filedict_get(&filedict2, "growing-key-199");
+    if (read.value == NULL || strcmp(read.value, "grew") != 0) {
+        printf("Reader couldn't see the new keys\n");
+        return 1;
+    }
+    printf("generation: %llu\n", ((filedict_header_t *)filedict2.data)->generation);
+    filedict_deinit(&filedict2);
+    filedict_deinit(&filedict);
+
+    printf("-------- several writer processes at once ---------\n");
+    filedict_init(&filedict);
+    filedict.features = FILEDICT_FEATURE_MULTI_WRITER;
+    filedict_open_f(&filedict, "test7.data", O_CREAT | O_TRUNC | O_RDWR, 16);
+    error_check();
+    filedict_deinit(&filedict);
+    /* Otherwise every writer would print whatever we haven't flushed yet again */
+    fflush(stdout);
+    for (i = 0; i < 4; ++i) {
+        if (fork() == 0) {
+            int j;
+            filedict_init(&filedict);
+            filedict_open(&filedict, "test7.data");
+            for (j = 0; j < 200 && filedict.error == NULL; ++j) {
+                snprintf(key, sizeof(key), "shared-key-%i", j);
+                snprintf(value, sizeof(value), "from writer %i", i);
+                filedict_insert(&filedict, key, value);
+            }
+            status = filedict.error != NULL;
+            filedict_deinit(&filedict);
+            exit(status);
+        }
+    }
+    for (i = 0; i < 4; ++i) {
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("A writer process failed\n");
+            return 1;
+        }
+    }
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test7.data");
+    error_check();
+    for (i = 0; i < 200; ++i) {
+        int value_count = 0;
+
+        snprintf(key, sizeof(key), "shared-key-%i", i);
+        read = filedict_get(&filedict, key);
+        for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+            value_count += 1;
+        }
+        if (value_count != 4) {
+            printf("%s has %i values instead of 4\n", key, value_count);
+            return 1;
+        }
+    }
+    printf("overflow bucket count: %llu\n", ((filedict_header_t *)filedict.data)->overflow_bucket_count);
+    filedict_deinit(&filedict);
+
+    printf("-------- file locks between descriptors of one process ---------\n");
+    filedict_init(&filedict);
+    filedict_open(&filedict, "test7.data");
+    error_check();
+    filedict_init(&filedict2);
+    filedict_open(&filedict2, "test7.data");
+    error_check2();
+    filedict_lock_growth(&filedict, F_WRLCK);
+    {
+        struct flock lock;
+
+        /*
+         * Threads of one process each have their own descriptor, and need to keep each other out.
+         * Only open file description locks do that, and they're the ones with no pid.
+         */
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = FILEDICT_LOCK_GROWTH;
+        lock.l_len = 1;
+        if (fcntl(filedict2.fd, F_OFD_GETLK, &lock) != 0 || lock.l_type == F_UNLCK || lock.l_pid != -1) {
+            printf("The growth lock isn't an open file description lock\n");
+            return 1;
+        }
+    }
+    filedict_lock_growth(&filedict, F_UNLCK);
+    filedict_deinit(&filedict2);
+    filedict_deinit(&filedict);
+
+    printf("-------- running `merge -j 4 test9.data test3.data test6.data` ---------\n");
+    unlink("test9.data");
+    status = system("./merge -j 4 test9.data test3.data test6.data");
+    printf("merge exited with status code %i\n", status);
+
+    filedict_init(&filedict);
+    filedict_open_readonly(&filedict, "test9.data");
+    error_check();
+    for (i = 0; i < 200; ++i) {
+        snprintf(key, sizeof(key), "many-keys-%i", i);
+        snprintf(value, sizeof(value), "value of %i", i);
+        read = filedict_get(&filedict, key);
+        if (read.value == NULL || strcmp(read.value, value) != 0) {
+            printf("Lookup of %s failed after merging\n", key);
+            return 1;
+        }
+    }
+    for (i = 0; i < 60; ++i) {
+        int value_count = 0;
+
+        snprintf(key, sizeof(key), "batch-key-%i", i);
+        read = filedict_get(&filedict, key);
+        for (success = read.value != NULL; success; success = filedict_get_next(&read)) {
+            value_count += 1;
+        }
+        if (value_count != 10) {
+            printf("%s has %i values after merging instead of 10\n", key, value_count);
+            return 1;
+        }
+    }
+    filedict_deinit(&filedict);
+
     printf("\nEverything went well?\n");
     return 0;
 }